@@ -1,20 +1,59 @@
 #define _CRT_SECURE_NO_WARNINGS
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
 #include <direct.h>
+#include <io.h>
+#include <fcntl.h>
+#include <process.h>
 #else
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <linux/fs.h>
 #endif
 #include <string>
 #include <vector>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <map>
+#include <list>
+#include <memory>
+#include <memory_resource>
+#include <algorithm>
+#include <set>
+#include <chrono>
 #include <nlohmann/json.hpp>
 
 #define FSYS_V1_MAX_TYPE 19
 #define FSYS_ENABLE_OVERRIDE 0x1
 #define FILE_COMPRESS_FLAG 0x80000000
+#define TAR_BLOCK_SIZE 512
+
+//GameCube disc image constants
+#define GCM_MAGIC 0xC2339F3D
+#define GCM_MAGIC_OFS 0x1C
+#define GCM_FST_OFS 0x424
+#define GCM_HEADER_SIZE 0x440
+
+//Entry server limits
+#define SERVER_MAX_LINE 0x10000
+#define SERVER_TIMEOUT_SEC 5
 
 //LZSS constants
 #define N                4096   /* size of ring buffer */
@@ -54,14 +93,31 @@ struct fsys_file_entry {
 	uint32_t name_ofs;
 };
 
+typedef std::pmr::vector<uint8_t> FSYSBuffer;
+
+struct MappedFile {
+	const uint8_t *data;
+	size_t size;
+	size_t pos;
+	void *map_base;
+	size_t map_size;
+};
+
+struct DiscFile {
+	std::string path;
+	uint32_t offset;
+	uint32_t size;
+};
+
 struct FSYSFile {
 	uint32_t id;
 	uint32_t offset;
-	std::vector<uint8_t> data;
-	std::vector<uint8_t> compressed_data;
+	FSYSBuffer data;
+	FSYSBuffer compressed_data;
 	bool compressed;
 	uint32_t type;
 	std::string name;
+	std::string hash;
 };
 
 struct FileTypeInfo {
@@ -100,8 +156,27 @@ std::vector<FileTypeInfo> known_file_types = {
 uint32_t fsys_version;
 bool fsys_enable_override;
 uint32_t fsys_archive_id;
+std::unique_ptr<std::pmr::monotonic_buffer_resource> fsys_arena;
 std::vector<FSYSFile> fsys_files;
 
+struct StoreStats {
+	uint32_t num_files;
+	uint64_t total_size;
+	uint32_t num_new;
+	uint64_t new_size;
+	uint32_t num_linked;
+	uint64_t linked_size;
+	uint32_t num_compressed;
+	uint32_t num_cached;
+};
+
+std::string fsys_store_dir;
+StoreStats store_stats;
+bool fsys_keep_compressed;
+std::string fsys_layout;
+bool fsys_share_data;
+uint32_t fsys_budget;
+
 //LZSS variables
 uint8_t text_buf[N + F - 1];    /* ring buffer of size N, with extra F-1 bytes to facilitate string comparison */
 int match_position, match_length;  /* of longest match.  These are set by the InsertNode() procedure. */
@@ -160,23 +235,9 @@ void to_json(nlohmann::ordered_json &j, const FSYSFile &file)
 		{ "type", type_info->name },
 		{ "compressed", file.compressed }
 	};
-}
-
-void from_json(const nlohmann::ordered_json &j, FSYSFile &file)
-{
-	std::string type_name;
-	FileTypeInfo *type_info;
-	j.at("id").get_to(file.id);
-	j.at("name").get_to(file.name);
-	j.at("type").get_to(type_name);
-	file.offset = 0;
-	file.compressed = j.value("compressed", false);
-	type_info = GetFileTypeName(type_name);
-	if (!type_info) {
-		std::cout << "Invalid file type name " << type_name << std::endl;
-		exit(1);
+	if (!file.hash.empty()) {
+		j["hash"] = file.hash;
 	}
-	file.type = type_info->type_id;
 }
 
 bool MakeDirectory(std::string dir)
@@ -190,38 +251,12 @@ bool MakeDirectory(std::string dir)
 	return ret != -1 || errno == EEXIST;
 }
 
-uint32_t ReadMemoryBufU32(uint8_t *buf)
+uint32_t ReadMemoryBufU32(const uint8_t *buf)
 {
 	//Convert 4 bytes into native endian 32-bit word
 	return (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
 }
 
-uint32_t ReadFileU32(FILE *file)
-{
-	uint8_t temp[4];
-	if (fread(&temp[0], 4, 1, file) != 1) {
-		std::cout << "Failed to read from file." << std::endl;
-		exit(1);
-	}
-	return ReadMemoryBufU32(temp);
-}
-
-std::string ReadFileString(FILE *file)
-{
-	uint8_t temp_char;
-	std::string string;
-	do {
-		if (fread(&temp_char, 1, 1, file) != 1) {
-			std::cout << "Failed to read from file." << std::endl;
-			exit(1);
-		}
-		if (temp_char != 0) {
-			string.push_back(temp_char);
-		}
-	} while (temp_char != 0);
-	return string;
-}
-
 void WriteMemoryBufU32(uint8_t *buf, uint32_t value)
 {
 	//Split value into bytes in big-endian order
@@ -262,6 +297,527 @@ void AlignFile(FILE *file, uint32_t alignment)
 	}
 }
 
+FILE *OpenStream(std::string name, bool write)
+{
+	//A name of - refers to stdin or stdout
+	if (name == "-") {
+		FILE *file = write ? stdout : stdin;
+#if defined(_WIN32)
+		_setmode(_fileno(file), _O_BINARY);
+#endif
+		return file;
+	}
+	return fopen(name.c_str(), write ? "wb" : "rb");
+}
+
+void CloseStream(FILE *file)
+{
+	if (file == stdin || file == stdout) {
+		fflush(file);
+	} else {
+		fclose(file);
+	}
+}
+
+bool MapFile(std::string filename, uint64_t offset, uint64_t size, MappedFile &map)
+{
+	//Maps size bytes at offset, or the rest of the file if size is UINT64_MAX
+	map.data = nullptr;
+	map.size = 0;
+	map.pos = 0;
+	map.map_base = nullptr;
+	map.map_size = 0;
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	LARGE_INTEGER file_size;
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	if (!GetFileSizeEx(file, &file_size) || offset > (uint64_t)file_size.QuadPart) {
+		CloseHandle(file);
+		return false;
+	}
+	if (size == UINT64_MAX) {
+		size = file_size.QuadPart - offset;
+	}
+	if (offset + size > (uint64_t)file_size.QuadPart) {
+		CloseHandle(file);
+		return false;
+	}
+	if (size == 0) {
+		CloseHandle(file);
+		return true;
+	}
+	SYSTEM_INFO system_info;
+	GetSystemInfo(&system_info);
+	uint64_t map_offset = offset - (offset % system_info.dwAllocationGranularity);
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (!mapping) {
+		return false;
+	}
+	map.map_size = (size_t)(size + offset - map_offset);
+	map.map_base = MapViewOfFile(mapping, FILE_MAP_READ, (DWORD)(map_offset >> 32), (DWORD)map_offset, map.map_size);
+	CloseHandle(mapping);
+	if (!map.map_base) {
+		return false;
+	}
+#else
+	int fd = open(filename.c_str(), O_RDONLY);
+	struct stat file_stat;
+	if (fd < 0) {
+		return false;
+	}
+	if (fstat(fd, &file_stat) != 0 || offset > (uint64_t)file_stat.st_size) {
+		close(fd);
+		return false;
+	}
+	if (size == UINT64_MAX) {
+		size = file_stat.st_size - offset;
+	}
+	if (offset + size > (uint64_t)file_stat.st_size) {
+		close(fd);
+		return false;
+	}
+	if (size == 0) {
+		close(fd);
+		return true;
+	}
+	uint64_t map_offset = offset - (offset % sysconf(_SC_PAGESIZE));
+	map.map_size = (size_t)(size + offset - map_offset);
+	map.map_base = mmap(nullptr, map.map_size, PROT_READ, MAP_PRIVATE, fd, map_offset);
+	close(fd);
+	if (map.map_base == MAP_FAILED) {
+		map.map_base = nullptr;
+		return false;
+	}
+#endif
+	map.data = (const uint8_t *)map.map_base + (offset - map_offset);
+	map.size = (size_t)size;
+	return true;
+}
+
+void UnmapFile(MappedFile &map)
+{
+	if (map.map_base) {
+#if defined(_WIN32)
+		UnmapViewOfFile(map.map_base);
+#else
+		munmap(map.map_base, map.map_size);
+#endif
+	}
+	map.map_base = nullptr;
+	map.data = nullptr;
+	map.size = 0;
+}
+
+void SeekMap(MappedFile &map, size_t ofs)
+{
+	map.pos = ofs;
+}
+
+const uint8_t *ReadMapData(MappedFile &map, size_t size)
+{
+	if (map.pos > map.size || size > map.size - map.pos) {
+		std::cout << "Failed to read from file." << std::endl;
+		exit(1);
+	}
+	const uint8_t *data = map.data + map.pos;
+	map.pos += size;
+	return data;
+}
+
+uint32_t ReadMapU32(MappedFile &map)
+{
+	return ReadMemoryBufU32(ReadMapData(map, 4));
+}
+
+std::string ReadMapString(MappedFile &map)
+{
+	std::string string;
+	uint8_t temp_char;
+	do {
+		temp_char = *ReadMapData(map, 1);
+		if (temp_char != 0) {
+			string.push_back(temp_char);
+		}
+	} while (temp_char != 0);
+	return string;
+}
+
+bool SplitDiscPath(std::string path, std::string &image, std::string &disc_path)
+{
+	//Paths inside disc images are written as image::path/in/disc
+	size_t separator_pos = path.find("::");
+	if (separator_pos == std::string::npos) {
+		return false;
+	}
+	image = path.substr(0, separator_pos);
+	disc_path = path.substr(separator_pos + 2);
+	if (!disc_path.empty() && disc_path[0] == '/') {
+		disc_path = disc_path.substr(1);
+	}
+	return true;
+}
+
+bool MatchGlob(const char *pattern, const char *string)
+{
+	while (*pattern) {
+		if (*pattern == '*') {
+			while (*pattern == '*') {
+				pattern++;
+			}
+			if (!*pattern) {
+				return true;
+			}
+			for (; *string; string++) {
+				if (MatchGlob(pattern, string)) {
+					return true;
+				}
+			}
+			return false;
+		}
+		if (!*string || (*pattern != '?' && *pattern != *string)) {
+			return false;
+		}
+		pattern++;
+		string++;
+	}
+	return !*string;
+}
+
+bool LoadDiscFiles(std::string image, std::vector<DiscFile> &files, std::string &error)
+{
+	//Every read is bounds checked so a damaged image is reported instead of exiting
+	MappedFile header;
+	MappedFile fst;
+	files.clear();
+	if (!MapFile(image, 0, GCM_HEADER_SIZE, header)) {
+		error = "Failed to open " + image + " for reading.";
+		return false;
+	}
+	SeekMap(header, GCM_MAGIC_OFS);
+	uint32_t magic = ReadMapU32(header);
+	SeekMap(header, GCM_FST_OFS);
+	uint32_t fst_ofs = ReadMapU32(header);
+	uint32_t fst_size = ReadMapU32(header);
+	UnmapFile(header);
+	if (magic != GCM_MAGIC) {
+		error = image + " is not a GameCube disc image.";
+		return false;
+	}
+	if (!MapFile(image, fst_ofs, fst_size, fst)) {
+		error = "Failed to read the file system table of " + image + ".";
+		return false;
+	}
+	//Root entry holds the total number of entries and names follow the entries
+	bool valid = fst.size >= 12;
+	uint32_t num_entries = 0;
+	if (valid) {
+		SeekMap(fst, 8);
+		num_entries = ReadMapU32(fst);
+		valid = (uint64_t)num_entries * 12 <= fst.size;
+	}
+	size_t str_ofs = (size_t)num_entries * 12;
+	std::vector<std::pair<uint32_t, std::string>> dirs = { { num_entries, "" } };
+	for (uint32_t i = 1; valid && i < num_entries; i++) {
+		while (dirs.size() > 1 && i >= dirs.back().first) {
+			dirs.pop_back();
+		}
+		SeekMap(fst, i * 12);
+		uint32_t name_info = ReadMapU32(fst);
+		uint32_t value1 = ReadMapU32(fst);
+		uint32_t value2 = ReadMapU32(fst);
+		size_t name_ofs = str_ofs + (name_info & 0xFFFFFF);
+		valid = name_ofs < fst.size && memchr(fst.data + name_ofs, 0, fst.size - name_ofs) != nullptr;
+		if (!valid) {
+			break;
+		}
+		SeekMap(fst, name_ofs);
+		std::string name = dirs.back().second + ReadMapString(fst);
+		if (name_info >> 24) {
+			//Directories store the index after their last child
+			dirs.push_back(std::make_pair(value2, name + "/"));
+		} else {
+			files.push_back(DiscFile{ name, value1, value2 });
+		}
+	}
+	UnmapFile(fst);
+	if (!valid) {
+		error = "The file system table of " + image + " is invalid.";
+		files.clear();
+		return false;
+	}
+	return true;
+}
+
+std::vector<DiscFile> ReadDiscFiles(std::string image)
+{
+	std::vector<DiscFile> files;
+	std::string error;
+	if (!LoadDiscFiles(image, files, error)) {
+		std::cout << error << std::endl;
+		exit(1);
+	}
+	return files;
+}
+
+std::vector<std::string> ExpandDiscPath(std::string path)
+{
+	std::string image;
+	std::string pattern;
+	std::vector<std::string> paths;
+	if (!SplitDiscPath(path, image, pattern)) {
+		paths.push_back(path);
+		return paths;
+	}
+	std::vector<DiscFile> files = ReadDiscFiles(image);
+	for (size_t i = 0; i < files.size(); i++) {
+		if (MatchGlob(pattern.c_str(), files[i].path.c_str())) {
+			paths.push_back(image + "::" + files[i].path);
+		}
+	}
+	if (paths.empty()) {
+		std::cout << "No files in " << image << " match " << pattern << "." << std::endl;
+		exit(1);
+	}
+	return paths;
+}
+
+bool MapDiscFile(std::string image, const std::vector<DiscFile> &files, std::string disc_path, MappedFile &map)
+{
+	//Map only the archive's window of the disc image
+	for (size_t i = 0; i < files.size(); i++) {
+		if (files[i].path == disc_path) {
+			return MapFile(image, files[i].offset, files[i].size, map);
+		}
+	}
+	return false;
+}
+
+bool MapFSYS(std::string in_file, MappedFile &map)
+{
+	std::string image;
+	std::string disc_path;
+	if (!SplitDiscPath(in_file, image, disc_path)) {
+		return MapFile(in_file, 0, UINT64_MAX, map);
+	}
+	return MapDiscFile(image, ReadDiscFiles(image), disc_path, map);
+}
+
+bool LoadFSYSMap(std::string in_file, MappedFile &map, std::string &error)
+{
+	//Same as MapFSYS but reports damaged disc images through error instead of exiting
+	std::string image;
+	std::string disc_path;
+	std::vector<DiscFile> files;
+	bool is_disc_path = SplitDiscPath(in_file, image, disc_path);
+	if (is_disc_path && !LoadDiscFiles(image, files, error)) {
+		return false;
+	}
+	bool mapped = (is_disc_path) ? MapDiscFile(image, files, disc_path, map) : MapFile(in_file, 0, UINT64_MAX, map);
+	if (!mapped) {
+		error = "Failed to open " + in_file + " for reading.";
+	}
+	return mapped;
+}
+
+std::string GetBaseName(std::string path)
+{
+	//Strip directory and extension from path
+	size_t slash_pos = path.find_last_of("\\/") + 1;
+	size_t dot_pos = path.find_last_of(".");
+	if (dot_pos == std::string::npos || dot_pos < slash_pos) {
+		dot_pos = path.length();
+	}
+	return path.substr(slash_pos, dot_pos - slash_pos);
+}
+
+std::string GetDiscOutputName(std::string out_dir, std::string disc_path)
+{
+	//Keep the disc directories so archives with the same name in different directories do not collide
+	std::string dir = out_dir;
+	size_t start = 0;
+	size_t slash_pos;
+	while ((slash_pos = disc_path.find('/', start)) != std::string::npos) {
+		std::string component = disc_path.substr(start, slash_pos - start);
+		start = slash_pos + 1;
+		if (component.empty() || component == "." || component == "..") {
+			continue;
+		}
+		dir += component + "/";
+		if (!MakeDirectory(dir)) {
+			std::cout << "Failed to create " << dir << "." << std::endl;
+			exit(1);
+		}
+	}
+	return dir + GetBaseName(disc_path);
+}
+
+std::string GetFilesDir(std::string json_filename)
+{
+	size_t slash_pos = json_filename.find_last_of("\\/") + 1;
+	return json_filename.substr(0, slash_pos) + GetBaseName(json_filename) + "/";
+}
+
+void WriteTarOctal(char *field, size_t size, uint64_t value)
+{
+	//Octal number padded with zeroes and null terminated
+	char temp[24];
+	snprintf(temp, sizeof(temp), "%0*llo", (int)(size - 1), (unsigned long long)value);
+	memcpy(field, temp, size);
+}
+
+uint64_t ReadTarOctal(const char *field, size_t size)
+{
+	uint64_t value = 0;
+	for (size_t i = 0; i < size && field[i]; i++) {
+		if (field[i] >= '0' && field[i] <= '7') {
+			value = (value << 3) | (field[i] - '0');
+		}
+	}
+	return value;
+}
+
+uint32_t GetTarChecksum(const uint8_t *header)
+{
+	//Checksum field is treated as 8 spaces
+	uint32_t checksum = 8 * ' ';
+	for (uint32_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+		if (i < 148 || i >= 156) {
+			checksum += header[i];
+		}
+	}
+	return checksum;
+}
+
+void WriteTarPadding(FILE *file, uint64_t size)
+{
+	static const uint8_t zero[TAR_BLOCK_SIZE] = { 0 };
+	uint32_t pad_size = (TAR_BLOCK_SIZE - (size % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
+	if (pad_size) {
+		fwrite(zero, pad_size, 1, file);
+	}
+}
+
+void WriteTarEntry(FILE *file, std::string name, const uint8_t *data, uint64_t size)
+{
+	uint8_t header[TAR_BLOCK_SIZE] = { 0 };
+	std::string prefix;
+	if (name.length() > 100) {
+		//Split long names into ustar prefix and name
+		size_t slash_pos = name.find_last_of('/', 155);
+		if (slash_pos == std::string::npos || name.length() - slash_pos - 1 > 100) {
+			std::cout << "Name " << name << " is too long for tar." << std::endl;
+			exit(1);
+		}
+		prefix = name.substr(0, slash_pos);
+		name = name.substr(slash_pos + 1);
+	}
+	memcpy(&header[0], name.c_str(), name.length());
+	WriteTarOctal((char *)&header[100], 8, 0644);
+	WriteTarOctal((char *)&header[108], 8, 0);
+	WriteTarOctal((char *)&header[116], 8, 0);
+	WriteTarOctal((char *)&header[124], 12, size);
+	WriteTarOctal((char *)&header[136], 12, time(nullptr));
+	header[156] = '0';
+	memcpy(&header[257], "ustar", 6);
+	memcpy(&header[263], "00", 2);
+	memcpy(&header[345], prefix.c_str(), prefix.length());
+	WriteTarOctal((char *)&header[148], 7, GetTarChecksum(header));
+	header[155] = ' ';
+	fwrite(header, TAR_BLOCK_SIZE, 1, file);
+	if (size) {
+		fwrite(data, size, 1, file);
+	}
+	WriteTarPadding(file, size);
+}
+
+void WriteTarEnd(FILE *file)
+{
+	//Archive ends with two zero blocks
+	static const uint8_t zero[TAR_BLOCK_SIZE * 2] = { 0 };
+	fwrite(zero, sizeof(zero), 1, file);
+}
+
+void ReadTarData(FILE *file, uint8_t *data, uint64_t size)
+{
+	if (size && fread(data, size, 1, file) != 1) {
+		std::cout << "Failed to read from tar stream." << std::endl;
+		exit(1);
+	}
+}
+
+void SkipTarData(FILE *file, uint64_t size)
+{
+	uint8_t temp[TAR_BLOCK_SIZE];
+	//Sequential skip so pipes work
+	while (size) {
+		uint64_t chunk_size = (size > TAR_BLOCK_SIZE) ? TAR_BLOCK_SIZE : size;
+		ReadTarData(file, temp, chunk_size);
+		size -= chunk_size;
+	}
+}
+
+bool ReadTarEntry(FILE *file, std::string &name, FSYSBuffer &data)
+{
+	uint8_t header[TAR_BLOCK_SIZE];
+	std::string long_name;
+	while (true) {
+		if (fread(header, TAR_BLOCK_SIZE, 1, file) != 1) {
+			return false;
+		}
+		bool is_zero = true;
+		for (uint32_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+			if (header[i] != 0) {
+				is_zero = false;
+				break;
+			}
+		}
+		if (is_zero) {
+			return false;
+		}
+		if (ReadTarOctal((char *)&header[148], 8) != GetTarChecksum(header)) {
+			std::cout << "Invalid tar header checksum." << std::endl;
+			exit(1);
+		}
+		uint64_t size = ReadTarOctal((char *)&header[124], 12);
+		uint64_t pad_size = (TAR_BLOCK_SIZE - (size % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
+		char type = header[156];
+		if (type == 'L') {
+			//GNU long name for the next entry
+			std::vector<uint8_t> name_data(size + 1, 0);
+			ReadTarData(file, &name_data[0], size);
+			SkipTarData(file, pad_size);
+			long_name = (char *)&name_data[0];
+			continue;
+		}
+		if (type != '0' && type != '\0') {
+			//Skip directories, links and extended headers
+			SkipTarData(file, size + pad_size);
+			long_name.clear();
+			continue;
+		}
+		if (!long_name.empty()) {
+			name = long_name;
+		} else {
+			name = std::string((char *)&header[0], strnlen((char *)&header[0], 100));
+			if (!memcmp(&header[257], "ustar", 5) && header[345] != 0) {
+				name = std::string((char *)&header[345], strnlen((char *)&header[345], 155)) + "/" + name;
+			}
+		}
+		if (name.compare(0, 2, "./") == 0) {
+			name = name.substr(2);
+		}
+		data.resize(size);
+		if (size) {
+			ReadTarData(file, &data[0], size);
+		}
+		SkipTarData(file, pad_size);
+		return true;
+	}
+}
+
 void InitTree(void)  /* initialize trees */
 {
 	int  i;
@@ -411,51 +967,650 @@ void CompressFSYSFile(FSYSFile &file)
 	WriteMemoryBufU32(&file.compressed_data[8], codesize);
 }
 
-void ReadJSON(std::string in_file)
+bool DecodeLZSS(uint8_t *dst, uint32_t dst_size, const uint8_t *src, uint32_t src_size)
 {
-	std::ifstream file(in_file);
-	if (!file.is_open()) {
-		std::cout << "Failed to open " << in_file << " for reading." << std::endl;
-		exit(1);
+	uint32_t dst_pos = 0;
+	size_t text_buf_pos = N - F;
+	uint32_t flag = 0;
+	if (src_size < 16) {
+		return false;
 	}
-	try {
-		nlohmann::ordered_json json = nlohmann::json::parse(file);
-		fsys_version = json.value("version", 513);
-		fsys_enable_override = json.value("override", false);
-		json.at("id").get_to(fsys_archive_id);
-		json.at("files").get_to(fsys_files);
-	} catch (nlohmann::json::exception &exception) {
-		std::cout << exception.what() << std::endl;
-		exit(1);
+	uint32_t magic = ReadMemoryBufU32(&src[0]);
+	uint32_t out_size = ReadMemoryBufU32(&src[4]);
+	const uint8_t *src_end = src + src_size;
+	if (magic != 'LZSS' || out_size > dst_size) {
+		return false;
 	}
-}
-
-void ReadFiles(std::string json_filename)
-{
-	size_t slash_pos = json_filename.find_last_of("\\/") + 1;
-	size_t dot_pos = json_filename.find_last_of(".");
-	std::string json_dir = json_filename.substr(0, slash_pos);
-	std::string json_name = json_filename.substr(slash_pos, dot_pos - slash_pos);
-	for (size_t i = 0; i < fsys_files.size(); i++) {
-		std::string filename = json_dir + json_name + "/" + GetFSYSFileName(fsys_files[i]);
-		FILE *file = fopen(filename.c_str(), "rb");
-		if (!file) {
-			std::cout << "Failed to open " << filename << " for writing." << std::endl;
-			exit(1);
+	src += 16;
+	memset(text_buf, 0, N+F-1);
+	while (dst_pos < out_size) {
+		//Stop at the end of the input instead of reading past it
+		if (!(flag & 0x100)) {
+			if (src == src_end) {
+				return false;
+			}
+			uint8_t value = *src++;
+			flag = 0xFF00 | value;
 		}
-		fseek(file, 0, SEEK_END);
-		fsys_files[i].data.resize(ftell(file));
-		fseek(file, 0, SEEK_SET);
-		fread(&fsys_files[i].data[0], fsys_files[i].data.size(), 1, file);
-		fclose(file);
-	}
-}
-
-void CompressFiles()
+		if (flag & 0x1) {
+			if (src == src_end) {
+				return false;
+			}
+			uint8_t value = *src++;
+			text_buf[text_buf_pos] = dst[dst_pos++] = value;
+			text_buf_pos = (text_buf_pos + 1) % N;
+		} else {
+			if (src_end - src < 2) {
+				return false;
+			}
+			uint8_t byte1 = *src++;
+			uint8_t byte2 = *src++;
+			size_t ofs = ((byte2 & 0xF0) << 4) | byte1;
+			size_t copy_size = (byte2 & 0xF) + THRESHOLD + 1;
+			//A match may run past the output size so clip it there
+			for (size_t i = 0; i < copy_size && dst_pos < out_size; i++) {
+				dst[dst_pos++] = text_buf[text_buf_pos] = text_buf[ofs];
+				ofs = (ofs + 1) % N;
+				text_buf_pos = (text_buf_pos + 1) % N;
+			}
+		}
+		flag >>= 1;
+	}
+	return true;
+}
+
+uint64_t ReadMemoryBufU64LE(const uint8_t *buf)
+{
+	uint64_t value = 0;
+	for (int i = 7; i >= 0; i--) {
+		value = (value << 8) | buf[i];
+	}
+	return value;
+}
+
+uint64_t RotateU64(uint64_t value, int bits)
+{
+	return (value << bits) | (value >> (64 - bits));
+}
+
+//xxHash64 constants
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+uint64_t XXH64Round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc = RotateU64(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+uint64_t XXH64Merge(uint64_t acc, uint64_t value)
+{
+	acc ^= XXH64Round(0, value);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+uint64_t HashData(const uint8_t *data, size_t size)
+{
+	//xxHash64 with a seed of 0
+	const uint8_t *end = data + size;
+	uint64_t hash;
+	if (size >= 32) {
+		uint64_t v1 = XXH_PRIME64_1 + XXH_PRIME64_2;
+		uint64_t v2 = XXH_PRIME64_2;
+		uint64_t v3 = 0;
+		uint64_t v4 = 0 - XXH_PRIME64_1;
+		while (end - data >= 32) {
+			v1 = XXH64Round(v1, ReadMemoryBufU64LE(data));
+			v2 = XXH64Round(v2, ReadMemoryBufU64LE(data + 8));
+			v3 = XXH64Round(v3, ReadMemoryBufU64LE(data + 16));
+			v4 = XXH64Round(v4, ReadMemoryBufU64LE(data + 24));
+			data += 32;
+		}
+		hash = RotateU64(v1, 1) + RotateU64(v2, 7) + RotateU64(v3, 12) + RotateU64(v4, 18);
+		hash = XXH64Merge(hash, v1);
+		hash = XXH64Merge(hash, v2);
+		hash = XXH64Merge(hash, v3);
+		hash = XXH64Merge(hash, v4);
+	} else {
+		hash = XXH_PRIME64_5;
+	}
+	hash += size;
+	while (end - data >= 8) {
+		hash ^= XXH64Round(0, ReadMemoryBufU64LE(data));
+		hash = RotateU64(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+		data += 8;
+	}
+	if (end - data >= 4) {
+		uint64_t value = (uint64_t)data[0] | ((uint64_t)data[1] << 8) | ((uint64_t)data[2] << 16) | ((uint64_t)data[3] << 24);
+		hash ^= value * XXH_PRIME64_1;
+		hash = RotateU64(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		data += 4;
+	}
+	while (data < end) {
+		hash ^= (*data++) * XXH_PRIME64_5;
+		hash = RotateU64(hash, 11) * XXH_PRIME64_1;
+	}
+	hash ^= hash >> 33;
+	hash *= XXH_PRIME64_2;
+	hash ^= hash >> 29;
+	hash *= XXH_PRIME64_3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+std::string GetStoreKey(const FSYSBuffer &data)
+{
+	//Key is the hash followed by the size to make collisions rarer
+	char key[32];
+	snprintf(key, sizeof(key), "%016llx-%x", (unsigned long long)HashData(data.data(), data.size()), (uint32_t)data.size());
+	return key;
+}
+
+bool ReadWholeFile(std::string filename, FSYSBuffer &data)
+{
+	FILE *file = fopen(filename.c_str(), "rb");
+	if (!file) {
+		return false;
+	}
+	fseek(file, 0, SEEK_END);
+	data.resize(ftell(file));
+	fseek(file, 0, SEEK_SET);
+	bool success = data.empty() || fread(&data[0], data.size(), 1, file) == 1;
+	fclose(file);
+	return success;
+}
+
+bool WriteWholeFile(std::string filename, const FSYSBuffer &data)
+{
+	FILE *file = fopen(filename.c_str(), "wb");
+	if (!file) {
+		return false;
+	}
+	bool success = data.empty() || fwrite(&data[0], data.size(), 1, file) == 1;
+	fclose(file);
+	return success;
+}
+
+std::string GetStorePath(std::string kind, std::string key)
+{
+	return fsys_store_dir + "/" + kind + "/" + key.substr(0, 2) + "/" + key;
+}
+
+std::string StoreObject(std::string kind, std::string key, const FSYSBuffer &data, bool &is_new)
+{
+	std::string path = GetStorePath(kind, key);
+	FSYSBuffer old_data;
+	is_new = false;
+	if (ReadWholeFile(path, old_data)) {
+		//Only share objects whose contents really match
+		return (old_data == data) ? path : "";
+	}
+	if (!MakeDirectory(fsys_store_dir) || !MakeDirectory(fsys_store_dir + "/" + kind)
+		|| !MakeDirectory(fsys_store_dir + "/" + kind + "/" + key.substr(0, 2))) {
+		std::cout << "Failed to create store directory for " << path << "." << std::endl;
+		exit(1);
+	}
+	//Write to a private name first so concurrent unpacks never see partial objects
+#if defined(_WIN32)
+	std::string temp_path = path + "." + std::to_string(_getpid()) + ".tmp";
+#else
+	std::string temp_path = path + "." + std::to_string(getpid()) + ".tmp";
+#endif
+	if (!WriteWholeFile(temp_path, data)) {
+		std::cout << "Failed to open " << temp_path << " for writing." << std::endl;
+		exit(1);
+	}
+#if !defined(_WIN32)
+	//Shared objects are read-only so editing a hardlinked copy in place fails instead of corrupting the store
+	chmod(temp_path.c_str(), 0444);
+#endif
+	if (rename(temp_path.c_str(), path.c_str()) != 0) {
+		//Another process stored the object first
+		remove(temp_path.c_str());
+		return ReadWholeFile(path, old_data) && old_data == data ? path : "";
+	}
+#if defined(_WIN32)
+	//Set after the rename since a read-only temp file could not be removed on failure
+	SetFileAttributesA(path.c_str(), FILE_ATTRIBUTE_READONLY);
+#endif
+	is_new = true;
+	return path;
+}
+
+bool LinkStoreObject(std::string object_path, std::string filename)
+{
+#if defined(_WIN32)
+	//Read-only files cannot be removed on Windows
+	SetFileAttributesA(filename.c_str(), FILE_ATTRIBUTE_NORMAL);
+#endif
+	remove(filename.c_str());
+#if defined(__linux__)
+	//Prefer a copy-on-write clone since it can be edited freely
+	int src_fd = open(object_path.c_str(), O_RDONLY);
+	if (src_fd >= 0) {
+		int dst_fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (dst_fd >= 0) {
+			bool cloned = ioctl(dst_fd, FICLONE, src_fd) == 0;
+			close(dst_fd);
+			if (cloned) {
+				close(src_fd);
+				return true;
+			}
+			remove(filename.c_str());
+		}
+		close(src_fd);
+	}
+#endif
+#if defined(_WIN32)
+	//Attributes are shared by all hardlinks so this also restores the flag if an old link was just cleared
+	SetFileAttributesA(object_path.c_str(), FILE_ATTRIBUTE_READONLY);
+	return CreateHardLinkA(filename.c_str(), object_path.c_str(), NULL) != 0;
+#else
+	return link(object_path.c_str(), filename.c_str()) == 0;
+#endif
+}
+
+void DumpStoreFile(FSYSFile &file, std::string filename)
+{
+	bool is_new;
+	file.hash = GetStoreKey(file.data);
+	std::string object_path = StoreObject("objects", file.hash, file.data, is_new);
+	store_stats.num_files++;
+	store_stats.total_size += file.data.size();
+	if (!object_path.empty() && LinkStoreObject(object_path, filename)) {
+		if (is_new) {
+			store_stats.num_new++;
+			store_stats.new_size += file.data.size();
+		} else {
+			store_stats.num_linked++;
+			store_stats.linked_size += file.data.size();
+		}
+	} else {
+		//Fall back to a private copy
+		if (!WriteWholeFile(filename, file.data)) {
+			std::cout << "Failed to open " << filename << " for writing." << std::endl;
+			exit(1);
+		}
+		store_stats.num_new++;
+		store_stats.new_size += file.data.size();
+	}
+	if (file.compressed && !file.compressed_data.empty()) {
+		//Keep the archive's compressed data so packing can reuse it
+		StoreObject("lzss", file.hash, file.compressed_data, is_new);
+	}
+}
+
+bool ReadStoreFile(FSYSFile &file)
+{
+	if (file.hash.empty() || !ReadWholeFile(GetStorePath("objects", file.hash), file.data)) {
+		return false;
+	}
+	return GetStoreKey(file.data) == file.hash;
+}
+
+bool ReadStoreCompressed(FSYSFile &file)
+{
+	std::string key = GetStoreKey(file.data);
+	if (!ReadWholeFile(GetStorePath("lzss", key), file.compressed_data)) {
+		return false;
+	}
+	//Verify the cached data before trusting it
+	if (file.compressed_data.size() < 16 || ReadMemoryBufU32(&file.compressed_data[0]) != 'LZSS'
+		|| ReadMemoryBufU32(&file.compressed_data[4]) != file.data.size()
+		|| ReadMemoryBufU32(&file.compressed_data[8]) != file.compressed_data.size()) {
+		return false;
+	}
+	FSYSBuffer data(file.data.size());
+	if (!data.empty() && !DecodeLZSS(&data[0], data.size(), &file.compressed_data[0], file.compressed_data.size())) {
+		return false;
+	}
+	return data == file.data;
+}
+
+void PrintStoreStats()
+{
+	if (store_stats.num_files) {
+		std::cout << "Store: " << store_stats.num_files << " files (" << store_stats.total_size << " bytes)" << std::endl;
+		std::cout << "Stored " << store_stats.num_new << " new objects (" << store_stats.new_size << " bytes)" << std::endl;
+		std::cout << "Linked " << store_stats.num_linked << " existing objects (" << store_stats.linked_size << " bytes)" << std::endl;
+		if (store_stats.new_size) {
+			std::cout << "Dedupe ratio: " << (double)store_stats.total_size / store_stats.new_size << std::endl;
+		} else {
+			std::cout << "Dedupe ratio: all files were already stored" << std::endl;
+		}
+	}
+	if (store_stats.num_compressed) {
+		std::cout << "Reused " << store_stats.num_cached << " of " << store_stats.num_compressed << " compressed files from store" << std::endl;
+	}
+}
+
+class FSYSJSONSax : public nlohmann::json_sax<nlohmann::ordered_json> {
+public:
+	bool null() override
+	{
+		return Value(nullptr, nullptr);
+	}
+
+	bool boolean(bool val) override
+	{
+		//get_to on a number key accepted booleans too
+		uint32_t value = val;
+		return Value(&value, &val);
+	}
+
+	bool number_integer(number_integer_t val) override
+	{
+		uint32_t value = (uint32_t)val;
+		return Value(&value, nullptr);
+	}
+
+	bool number_unsigned(number_unsigned_t val) override
+	{
+		uint32_t value = (uint32_t)val;
+		return Value(&value, nullptr);
+	}
+
+	bool number_float(number_float_t val, const string_t &) override
+	{
+		uint32_t value = (uint32_t)val;
+		return Value(&value, nullptr);
+	}
+
+	bool string(string_t &val) override
+	{
+		if (depth == 3 && in_files) {
+			if (file_key == "name") {
+				fsys_files.back().name = val;
+				has_name = true;
+			} else if (file_key == "type") {
+				file_types.back() = val;
+				has_type = true;
+			} else if (file_key == "hash") {
+				fsys_files.back().hash = val;
+			} else {
+				return Value(nullptr, nullptr);
+			}
+			return true;
+		}
+		return Value(nullptr, nullptr);
+	}
+
+	bool binary(binary_t &) override
+	{
+		return Value(nullptr, nullptr);
+	}
+
+	bool start_object(std::size_t) override
+	{
+		if (depth == 0) {
+			fsys_version = 513;
+			fsys_enable_override = false;
+			fsys_files.clear();
+		} else if (depth == 1 && !Value(nullptr, nullptr)) {
+			return false;
+		} else if (depth == 3 && in_files && !Value(nullptr, nullptr)) {
+			return false;
+		} else if (depth == 2 && in_files) {
+			//Start a new file entry
+			FSYSFile file = {};
+			fsys_files.push_back(std::move(file));
+			file_types.emplace_back();
+			has_file_id = has_name = has_type = false;
+		}
+		depth++;
+		return true;
+	}
+
+	bool end_object() override
+	{
+		depth--;
+		if (depth == 2 && in_files) {
+			if (!has_file_id || !has_name || !has_type) {
+				std::cout << "File entry " << fsys_files.size() - 1 << " is missing id, name, or type." << std::endl;
+				return false;
+			}
+		} else if (depth == 0 && !has_id) {
+			std::cout << "Archive id is missing." << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	bool start_array(std::size_t) override
+	{
+		if (depth == 0) {
+			std::cout << "JSON root must be an object." << std::endl;
+			return false;
+		}
+		if (depth == 1) {
+			if (root_key != "files") {
+				if (!Value(nullptr, nullptr)) {
+					return false;
+				}
+			} else {
+				in_files = true;
+				has_files = true;
+			}
+		} else if ((depth == 2 || depth == 3) && in_files && !Value(nullptr, nullptr)) {
+			return false;
+		}
+		depth++;
+		return true;
+	}
+
+	bool end_array() override
+	{
+		depth--;
+		if (depth == 1) {
+			in_files = false;
+		}
+		return true;
+	}
+
+	bool key(string_t &val) override
+	{
+		if (depth == 1) {
+			root_key = val;
+		} else if (depth == 3) {
+			file_key = val;
+		}
+		return true;
+	}
+
+	bool parse_error(std::size_t, const std::string &, const nlohmann::detail::exception &ex) override
+	{
+		std::cout << ex.what() << std::endl;
+		return false;
+	}
+
+	bool Finish()
+	{
+		if (!has_files) {
+			std::cout << "Archive files list is missing." << std::endl;
+			return false;
+		}
+		//Types are resolved last since they depend on the version
+		for (size_t i = 0; i < fsys_files.size(); i++) {
+			FileTypeInfo *type_info = GetFileTypeName(file_types[i]);
+			if (!type_info) {
+				std::cout << "Invalid file type name " << file_types[i] << std::endl;
+				return false;
+			}
+			fsys_files[i].type = type_info->type_id;
+		}
+		return true;
+	}
+
+private:
+	bool Value(uint32_t *number, bool *flag)
+	{
+		bool valid = true;
+		if (depth == 0) {
+			std::cout << "JSON root must be an object." << std::endl;
+			return false;
+		}
+		if (depth == 1) {
+			if (root_key == "version") {
+				valid = number != nullptr;
+				fsys_version = number ? *number : 0;
+			} else if (root_key == "override") {
+				valid = flag != nullptr;
+				fsys_enable_override = flag ? *flag : false;
+			} else if (root_key == "id") {
+				valid = number != nullptr;
+				fsys_archive_id = number ? *number : 0;
+				has_id = true;
+			} else if (root_key == "files") {
+				valid = false;
+			}
+			if (!valid) {
+				std::cout << "Invalid value for key " << root_key << "." << std::endl;
+			}
+		} else if (depth == 2 && in_files) {
+			std::cout << "File entry " << fsys_files.size() << " is not an object." << std::endl;
+			valid = false;
+		} else if (depth == 3 && in_files) {
+			FSYSFile &file = fsys_files.back();
+			if (file_key == "id") {
+				valid = number != nullptr;
+				file.id = number ? *number : 0;
+				has_file_id = true;
+			} else if (file_key == "compressed") {
+				valid = flag != nullptr;
+				file.compressed = flag ? *flag : false;
+			} else if (file_key == "name" || file_key == "type" || file_key == "hash") {
+				valid = false;
+			}
+			if (!valid) {
+				std::cout << "Invalid value for key " << file_key << " in file entry " << fsys_files.size() - 1 << "." << std::endl;
+			}
+		}
+		return valid;
+	}
+
+	int depth = 0;
+	bool in_files = false;
+	bool has_id = false;
+	bool has_files = false;
+	bool has_file_id = false;
+	bool has_name = false;
+	bool has_type = false;
+	std::string root_key;
+	std::string file_key;
+	std::vector<std::string> file_types;
+};
+
+template <typename InputType>
+bool ParseJSON(InputType &&input)
+{
+	//Fill fsys_files directly without building a JSON document
+	FSYSJSONSax sax;
+	return nlohmann::ordered_json::sax_parse(input, &sax) && sax.Finish();
+}
+
+bool LoadJSON(std::string in_file)
+{
+	std::ifstream file(in_file);
+	if (!file.is_open()) {
+		std::cout << "Failed to open " << in_file << " for reading." << std::endl;
+		return false;
+	}
+	return ParseJSON(file);
+}
+
+void ReadJSON(std::string in_file)
+{
+	if (!LoadJSON(in_file)) {
+		exit(1);
+	}
+}
+
+bool ReadFileData(std::string files_dir, FSYSFile &file)
+{
+	if (ReadWholeFile(files_dir + GetFSYSFileName(file), file.data)) {
+		return true;
+	}
+	//Missing files are resolved through the store
+	return !fsys_store_dir.empty() && ReadStoreFile(file);
+}
+
+void ReadFiles(std::string json_filename)
+{
+	std::string files_dir = GetFilesDir(json_filename);
+	for (size_t i = 0; i < fsys_files.size(); i++) {
+		if (!ReadFileData(files_dir, fsys_files[i])) {
+			std::cout << "Failed to open " << files_dir + GetFSYSFileName(fsys_files[i]) << " for reading." << std::endl;
+			exit(1);
+		}
+	}
+}
+
+void ReadTar(std::string in_file)
+{
+	FILE *file = OpenStream(in_file, false);
+	std::map<std::string, FSYSBuffer> entries;
+	std::string name;
+	FSYSBuffer data;
+	std::string json_name;
+	if (!file) {
+		std::cout << "Failed to open " << in_file << " for reading." << std::endl;
+		exit(1);
+	}
+	while (ReadTarEntry(file, name, data)) {
+		//First JSON file outside of a files directory is the manifest
+		if (json_name.empty() && name.length() > 5 && name.compare(name.length() - 5, 5, ".json") == 0
+			&& name.find('/') == std::string::npos) {
+			json_name = name;
+			if (!ParseJSON(data)) {
+				exit(1);
+			}
+		} else {
+			entries[name].swap(data);
+		}
+	}
+	CloseStream(file);
+	if (json_name.empty()) {
+		std::cout << "No JSON manifest found in " << in_file << "." << std::endl;
+		exit(1);
+	}
+	std::string files_dir = GetFilesDir(json_name);
+	for (size_t i = 0; i < fsys_files.size(); i++) {
+		std::string filename = files_dir + GetFSYSFileName(fsys_files[i]);
+		auto entry = entries.find(filename);
+		if (entry == entries.end()) {
+			std::cout << "Failed to find " << filename << " in " << in_file << "." << std::endl;
+			exit(1);
+		}
+		fsys_files[i].data.swap(entry->second);
+	}
+}
+
+void CompressFileData(FSYSFile &file)
+{
+	if (fsys_store_dir.empty()) {
+		CompressFSYSFile(file);
+		return;
+	}
+	//Reuse compressed data cached in the store
+	store_stats.num_compressed++;
+	if (ReadStoreCompressed(file)) {
+		store_stats.num_cached++;
+		return;
+	}
+	bool is_new;
+	CompressFSYSFile(file);
+	StoreObject("lzss", GetStoreKey(file.data), file.compressed_data, is_new);
+}
+
+void CompressFiles()
 {
 	for (size_t i = 0; i < fsys_files.size(); i++) {
 		if (fsys_files[i].compressed) {
-			CompressFSYSFile(fsys_files[i]);
+			CompressFileData(fsys_files[i]);
 		}
 	}
 }
@@ -501,55 +1656,244 @@ void MakeOfsTable(fsys_offsets_data &offsets, uint32_t base_ofs)
 	AlignU32(offsets.data_ofs, 32);
 }
 
-void CalcDataOffsets(uint32_t base_ofs)
+uint32_t GetFSYSFileDataSize(const FSYSFile &file)
 {
-	uint32_t ofs = base_ofs;
-	for (size_t i = 0; i < fsys_files.size(); i++) {
-		uint32_t data_size = (fsys_files[i].compressed) ? fsys_files[i].compressed_data.size() : fsys_files[i].data.size();
-		AlignU32(data_size, 32);
-		fsys_files[i].offset = ofs;
-		ofs += data_size;
-	}
+	return (file.compressed) ? file.compressed_data.size() : file.data.size();
 }
 
-void WriteFSYSHeader(FILE *file, fsys_header_data &header)
+const FSYSBuffer &GetFSYSFileStoredData(const FSYSFile &file)
 {
-	fseek(file, 0, SEEK_SET);
-	WriteFileU32(file, header.magic);
-	WriteFileU32(file, header.version);
-	WriteFileU32(file, header.archive_id);
-	WriteFileU32(file, header.num_files);
-	WriteFileU32(file, header.flags);
-	WriteFileU32(file, header.unk);
-	WriteFileU32(file, header.ofs_table_ofs);
-	WriteFileU32(file, header.data_start_ofs);
-	WriteFileU32(file, header.fsys_size);
-	AlignFile(file, 32);
+	return (file.compressed) ? file.compressed_data : file.data;
 }
 
-void WriteFSYSOffsetData(FILE *file, fsys_offsets_data &offsets, uint32_t offset)
+bool LayoutTraceMatches(const FSYSFile &file, std::string name)
 {
-	fseek(file, offset, SEEK_SET);
-	WriteFileU32(file, offsets.file_list_ofs);
-	WriteFileU32(file, offsets.str_ofs);
-	WriteFileU32(file, offsets.data_ofs);
-	AlignFile(file, 32);
+	return file.name == name || GetFSYSFileName(file) == name;
 }
 
-void WriteFSYSFileList(FILE *file, uint32_t file_list_ofs, uint32_t file_entry_ofs)
+std::vector<uint32_t> GetDataSizes()
 {
-	fseek(file, file_list_ofs, SEEK_SET);
-	for (uint32_t i = 0; i < fsys_files.size(); i++) {
-		WriteFileU32(file, file_entry_ofs + (i * FSYSGetFileListEntrySize()));
+	std::vector<uint32_t> sizes;
+	for (size_t i = 0; i < fsys_files.size(); i++) {
+		sizes.push_back(GetFSYSFileDataSize(fsys_files[i]));
 	}
-	AlignFile(file, 16);
+	return sizes;
 }
 
-void WriteFSYSStringTable(FILE *file, uint32_t string_ofs)
+std::vector<size_t> GetLayoutOrder(const std::vector<uint32_t> &sizes)
 {
-	fseek(file, string_ofs, SEEK_SET);
-	for (uint32_t i = 0; i < fsys_files.size(); i++) {
-		WriteFileString(file, fsys_files[i].name);
+	std::vector<size_t> order;
+	for (size_t i = 0; i < fsys_files.size(); i++) {
+		order.push_back(i);
+	}
+	if (fsys_layout == "size") {
+		//Small files first so they are grouped at the start of the data
+		std::stable_sort(order.begin(), order.end(), [&sizes](size_t a, size_t b) {
+			return sizes[a] < sizes[b];
+		});
+	} else if (fsys_layout == "type") {
+		//Group files by type in order of first appearance
+		std::vector<uint32_t> types;
+		for (size_t i = 0; i < fsys_files.size(); i++) {
+			if (std::find(types.begin(), types.end(), fsys_files[i].type) == types.end()) {
+				types.push_back(fsys_files[i].type);
+			}
+		}
+		std::stable_sort(order.begin(), order.end(), [&types](size_t a, size_t b) {
+			return std::find(types.begin(), types.end(), fsys_files[a].type) < std::find(types.begin(), types.end(), fsys_files[b].type);
+		});
+	} else if (fsys_layout.compare(0, 6, "trace:") == 0) {
+		//Files named in the trace come first in access order
+		std::string trace_path = fsys_layout.substr(6);
+		std::ifstream trace_file(trace_path);
+		std::string line;
+		std::vector<bool> placed(fsys_files.size(), false);
+		if (!trace_file.is_open()) {
+			std::cout << "Failed to open " << trace_path << " for reading." << std::endl;
+			exit(1);
+		}
+		order.clear();
+		while (std::getline(trace_file, line)) {
+			if (!line.empty() && line.back() == '\r') {
+				line.pop_back();
+			}
+			for (size_t i = 0; i < fsys_files.size(); i++) {
+				if (!placed[i] && LayoutTraceMatches(fsys_files[i], line)) {
+					order.push_back(i);
+					placed[i] = true;
+				}
+			}
+		}
+		for (size_t i = 0; i < fsys_files.size(); i++) {
+			if (!placed[i]) {
+				order.push_back(i);
+			}
+		}
+	}
+	return order;
+}
+
+std::vector<size_t> PlaceDataOffsets(uint32_t base_ofs, const std::vector<uint32_t> &sizes, const std::vector<std::string> &keys)
+{
+	//With --share, files with the same key reuse the data of the first one in layout order
+	uint32_t ofs = base_ofs;
+	std::vector<size_t> shared_with(fsys_files.size(), SIZE_MAX);
+	std::map<std::string, size_t> first_files;
+	std::vector<size_t> order = GetLayoutOrder(sizes);
+	for (size_t i = 0; i < order.size(); i++) {
+		uint32_t data_size = sizes[order[i]];
+		if (fsys_share_data && data_size != 0 && !keys[order[i]].empty()) {
+			auto first_file = first_files.emplace(keys[order[i]], order[i]);
+			if (!first_file.second) {
+				fsys_files[order[i]].offset = fsys_files[first_file.first->second].offset;
+				shared_with[order[i]] = first_file.first->second;
+				continue;
+			}
+		}
+		AlignU32(data_size, 32);
+		fsys_files[order[i]].offset = ofs;
+		ofs += data_size;
+	}
+	return shared_with;
+}
+
+std::vector<std::string> GetDataKeys()
+{
+	std::vector<std::string> keys;
+	std::map<std::string, size_t> first_files;
+	for (size_t i = 0; i < fsys_files.size(); i++) {
+		const FSYSBuffer &data = GetFSYSFileStoredData(fsys_files[i]);
+		std::string key = GetStoreKey(data);
+		auto first_file = first_files.emplace(key, i);
+		if (!first_file.second && GetFSYSFileStoredData(fsys_files[first_file.first->second]) != data) {
+			//Never share data on a hash collision
+			key += "-" + std::to_string(i);
+		}
+		keys.push_back(key);
+	}
+	return keys;
+}
+
+void CalcDataOffsets(uint32_t base_ofs)
+{
+	std::vector<std::string> keys(fsys_files.size());
+	if (fsys_share_data) {
+		keys = GetDataKeys();
+	}
+	PlaceDataOffsets(base_ofs, GetDataSizes(), keys);
+}
+
+uint32_t GetFSYSSize(uint32_t data_ofs, const std::vector<uint32_t> &sizes)
+{
+	//Archive ends after the last file data or the file entries, followed by the footer
+	uint32_t end_ofs = data_ofs;
+	for (size_t i = 0; i < fsys_files.size(); i++) {
+		uint32_t data_end = fsys_files[i].offset + sizes[i];
+		AlignU32(data_end, 32);
+		if (sizes[i] && data_end > end_ofs) {
+			end_ofs = data_end;
+		}
+	}
+	return end_ofs + 32;
+}
+
+void PrintLayoutReport()
+{
+	uint32_t data_start = UINT32_MAX;
+	uint32_t data_end = 0;
+	uint32_t manifest_size = 0;
+	uint32_t padding_size = 0;
+	std::set<uint32_t> placed_offsets;
+	for (size_t i = 0; i < fsys_files.size(); i++) {
+		uint32_t data_size = GetFSYSFileDataSize(fsys_files[i]);
+		uint32_t aligned_size = data_size;
+		AlignU32(aligned_size, 32);
+		manifest_size += aligned_size;
+		if (fsys_files[i].offset < data_start) {
+			data_start = fsys_files[i].offset;
+		}
+		if (fsys_files[i].offset + aligned_size > data_end) {
+			data_end = fsys_files[i].offset + aligned_size;
+		}
+		if (data_size && placed_offsets.insert(fsys_files[i].offset).second) {
+			padding_size += aligned_size - data_size;
+		}
+	}
+	if (fsys_files.empty()) {
+		data_start = data_end = 0;
+	}
+	std::cout << "Layout " << (fsys_layout.empty() ? "manifest" : fsys_layout) << ": " << (data_end - data_start) << " bytes of file data (" << padding_size << " bytes padding)" << std::endl;
+	if (fsys_share_data) {
+		std::cout << "Saved " << (manifest_size - (data_end - data_start)) << " bytes by sharing identical data" << std::endl;
+	}
+	//Count the contiguous reads needed to load each type
+	std::vector<uint32_t> types;
+	for (size_t i = 0; i < fsys_files.size(); i++) {
+		if (std::find(types.begin(), types.end(), fsys_files[i].type) == types.end()) {
+			types.push_back(fsys_files[i].type);
+		}
+	}
+	for (size_t i = 0; i < types.size(); i++) {
+		std::map<uint32_t, uint32_t> spans;
+		for (size_t j = 0; j < fsys_files.size(); j++) {
+			if (fsys_files[j].type == types[i]) {
+				uint32_t aligned_size = GetFSYSFileDataSize(fsys_files[j]);
+				AlignU32(aligned_size, 32);
+				spans[fsys_files[j].offset] = std::max(spans[fsys_files[j].offset], fsys_files[j].offset + aligned_size);
+			}
+		}
+		uint32_t num_reads = 0;
+		uint32_t read_end = 0;
+		for (auto &span : spans) {
+			if (num_reads == 0 || span.first > read_end) {
+				num_reads++;
+			}
+			read_end = std::max(read_end, span.second);
+		}
+		FileTypeInfo *type_info = GetFileTypeID(types[i]);
+		std::cout << ((type_info) ? type_info->name : std::to_string(types[i])) << ": " << spans.size() << " regions in "
+			<< num_reads << " reads spanning 0x" << std::hex << spans.begin()->first << "-0x" << read_end << std::dec << std::endl;
+	}
+}
+
+void WriteFSYSHeader(FILE *file, fsys_header_data &header)
+{
+	fseek(file, 0, SEEK_SET);
+	WriteFileU32(file, header.magic);
+	WriteFileU32(file, header.version);
+	WriteFileU32(file, header.archive_id);
+	WriteFileU32(file, header.num_files);
+	WriteFileU32(file, header.flags);
+	WriteFileU32(file, header.unk);
+	WriteFileU32(file, header.ofs_table_ofs);
+	WriteFileU32(file, header.data_start_ofs);
+	WriteFileU32(file, header.fsys_size);
+	AlignFile(file, 32);
+}
+
+void WriteFSYSOffsetData(FILE *file, fsys_offsets_data &offsets, uint32_t offset)
+{
+	fseek(file, offset, SEEK_SET);
+	WriteFileU32(file, offsets.file_list_ofs);
+	WriteFileU32(file, offsets.str_ofs);
+	WriteFileU32(file, offsets.data_ofs);
+	AlignFile(file, 32);
+}
+
+void WriteFSYSFileList(FILE *file, uint32_t file_list_ofs, uint32_t file_entry_ofs)
+{
+	fseek(file, file_list_ofs, SEEK_SET);
+	for (uint32_t i = 0; i < fsys_files.size(); i++) {
+		WriteFileU32(file, file_entry_ofs + (i * FSYSGetFileListEntrySize()));
+	}
+	AlignFile(file, 16);
+}
+
+void WriteFSYSStringTable(FILE *file, uint32_t string_ofs)
+{
+	fseek(file, string_ofs, SEEK_SET);
+	for (uint32_t i = 0; i < fsys_files.size(); i++) {
+		WriteFileString(file, fsys_files[i].name);
 	}
 	if (fsys_enable_override) {
 		for (uint32_t i = 0; i < fsys_files.size(); i++) {
@@ -587,312 +1931,1456 @@ void WriteFSYSFileEntry(FILE *file, uint32_t offset, fsys_file_entry &entry)
 		for (uint32_t i = 0; i < 18; i++) {
 			WriteFileU32(file, 0);
 		}
-	} else {
-		for (uint32_t i = 0; i < 3; i++) {
-			WriteFileU32(file, 0);
+	} else {
+		for (uint32_t i = 0; i < 3; i++) {
+			WriteFileU32(file, 0);
+		}
+		for (uint32_t i = 0; i < 3; i++) {
+			WriteFileU32(file, 0x11111111);
+		}
+		for (uint32_t i = 0; i < 4; i++) {
+			WriteFileU32(file, 0);
+		}
+	}
+}
+void WriteFSYSFileEntries(FILE *file, uint32_t file_entry_ofs, uint32_t string_ofs)
+{
+	uint32_t entry_size = FSYSGetFileListEntrySize();
+	uint32_t name_ofs = string_ofs;
+	uint32_t filename_ofs = name_ofs + FSYSGetNameSize();
+	std::set<uint32_t> written_offsets;
+	for (uint32_t i = 0; i < fsys_files.size(); i++) {
+		fsys_file_entry file_entry;
+		file_entry.id = fsys_files[i].id;
+		file_entry.offset = fsys_files[i].offset;
+		file_entry.size = fsys_files[i].data.size();
+		file_entry.unk = 0;
+		if (fsys_files[i].compressed) {
+			file_entry.flags = FILE_COMPRESS_FLAG;
+			file_entry.compressed_size = fsys_files[i].compressed_data.size();
+		} else {
+			file_entry.flags = 0;
+			file_entry.compressed_size = file_entry.size;
+		}
+		file_entry.unk2 = 0;
+		file_entry.filename_ofs = 0;
+		if (fsys_enable_override) {
+			file_entry.filename_ofs = filename_ofs;
+			filename_ofs += GetFSYSFileName(fsys_files[i]).length() + 1;
+		}
+		file_entry.type = fsys_files[i].type;
+		file_entry.name_ofs = name_ofs;
+		WriteFSYSFileEntry(file, file_entry_ofs + (i * entry_size), file_entry);
+		if (file_entry.compressed_size == 0 || written_offsets.insert(file_entry.offset).second) {
+			WriteFSYSFileData(file, i);
+		}
+		name_ofs += fsys_files[i].name.length() + 1;
+	}
+	fseek(file, file_entry_ofs + (fsys_files.size() * entry_size), SEEK_SET);
+	AlignFile(file, 32);
+}
+
+void WriteFSYSFiles(FILE *file, uint32_t file_list_ofs, uint32_t string_ofs, uint32_t file_entry_ofs)
+{
+	WriteFSYSFileList(file, file_list_ofs, file_entry_ofs);
+	WriteFSYSStringTable(file, string_ofs);
+	WriteFSYSFileEntries(file, file_entry_ofs, string_ofs);
+}
+
+void WriteFSYSFooter(FILE *file)
+{
+	fseek(file, 0, SEEK_END);
+	WriteFileU32(file, 0);
+	WriteFileU32(file, 0);
+	WriteFileU32(file, 0);
+	WriteFileU32(file, 0);
+	WriteFileU32(file, 0);
+	WriteFileU32(file, 0);
+	WriteFileU32(file, 0);
+	WriteFileU32(file, 'FSYS');
+}
+
+void MakeFSYSHeader(fsys_header_data &header, fsys_offsets_data &offsets)
+{
+	header.magic = 'FSYS';
+	header.version = fsys_version;
+	header.archive_id = fsys_archive_id;
+	header.num_files = fsys_files.size();
+	header.flags = 0x80000000;
+	if (fsys_enable_override) {
+		header.flags |= FSYS_ENABLE_OVERRIDE;
+	}
+	header.unk = 3;
+	header.ofs_table_ofs = sizeof(fsys_header_data);
+	header.data_start_ofs = 0;
+	header.fsys_size = 0;
+	AlignU32(header.ofs_table_ofs, 32);
+	MakeOfsTable(offsets, header.ofs_table_ofs);
+	header.data_start_ofs = offsets.data_ofs;
+}
+
+bool CheckFSYSBudget(uint32_t fsys_size)
+{
+	if (fsys_budget && fsys_size > fsys_budget) {
+		std::cout << "Archive size " << fsys_size << " exceeds the budget of " << fsys_budget << " bytes." << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool SaveFSYS(std::string filename)
+{
+	FILE *file;
+	fsys_header_data header;
+	fsys_offsets_data offsets;
+	MakeFSYSHeader(header, offsets);
+	CalcDataOffsets(header.data_start_ofs);
+	//Check the budget before touching the output
+	if (!CheckFSYSBudget(GetFSYSSize(header.data_start_ofs, GetDataSizes()))) {
+		return false;
+	}
+	file = fopen(filename.c_str(), "wb");
+	if (!file) {
+		std::cout << "Failed to open " << filename << " for writing." << std::endl;
+		return false;
+	}
+	WriteFSYSHeader(file, header);
+	WriteFSYSOffsetData(file, offsets, header.ofs_table_ofs);
+	WriteFSYSFiles(file, offsets.file_list_ofs, offsets.str_ofs, offsets.str_ofs + FSYSGetStringDataSize());
+	WriteFSYSFooter(file);
+	header.fsys_size = ftell(file);
+	WriteFSYSHeader(file, header);
+	fclose(file);
+	return true;
+}
+
+void WriteFSYS(std::string filename)
+{
+	if (!SaveFSYS(filename)) {
+		exit(1);
+	}
+}
+
+bool GetInputFileSize(std::string filename, uint32_t &size)
+{
+	FILE *file = fopen(filename.c_str(), "rb");
+	if (!file) {
+		return false;
+	}
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	fclose(file);
+	return true;
+}
+
+uint32_t GetLZSSMinSize(uint32_t size)
+{
+	//Cheapest possible coding: matches of F bytes in 2 bytes each plus a flag bit per token
+	uint32_t num_tokens = size / F;
+	uint32_t code_size = num_tokens * 2;
+	uint32_t remainder = size % F;
+	if (remainder > THRESHOLD || (remainder == 2 && num_tokens != 0)) {
+		//One more match, splitting the last full match if needed
+		num_tokens++;
+		code_size += 2;
+	} else {
+		//Too short for a match so stored as literals
+		num_tokens += remainder;
+		code_size += remainder;
+	}
+	return 16 + code_size + ((num_tokens + 7) / 8);
+}
+
+uint32_t GetLZSSMaxSize(uint32_t size)
+{
+	//Every byte stored as a literal plus a flag bit
+	return 16 + size + ((size + 7) / 8);
+}
+
+void PlanFSYS(std::string in_file)
+{
+	std::string files_dir = GetFilesDir(in_file);
+	std::vector<uint32_t> sizes;
+	std::vector<uint32_t> min_sizes;
+	std::vector<uint32_t> max_sizes;
+	std::vector<std::string> keys;
+	uint32_t num_estimated = 0;
+	ReadJSON(in_file);
+	for (size_t i = 0; i < fsys_files.size(); i++) {
+		FSYSFile &file = fsys_files[i];
+		std::string filename = files_dir + GetFSYSFileName(file);
+		std::string key;
+		uint32_t size;
+		uint32_t stored_size;
+		if (GetInputFileSize(filename, size)) {
+			//Contents are only needed to find cached compression or shared data
+			if ((file.compressed && !fsys_store_dir.empty()) || fsys_share_data) {
+				FSYSBuffer data;
+				if (!ReadWholeFile(filename, data)) {
+					std::cout << "Failed to open " << filename << " for reading." << std::endl;
+					exit(1);
+				}
+				key = GetStoreKey(data);
+			}
+		} else if (!fsys_store_dir.empty() && !file.hash.empty() && GetInputFileSize(GetStorePath("objects", file.hash), size)) {
+			key = file.hash;
+		} else {
+			std::cout << "Failed to open " << filename << " for reading." << std::endl;
+			exit(1);
+		}
+		sizes.push_back(size);
+		//Identical input packs to identical stored data when compressed the same way
+		keys.push_back(key.empty() ? key : key + (file.compressed ? "c" : "u"));
+		if (!file.compressed) {
+			min_sizes.push_back(size);
+			max_sizes.push_back(size);
+		} else if (!fsys_store_dir.empty() && !key.empty() && GetInputFileSize(GetStorePath("lzss", key), stored_size)) {
+			min_sizes.push_back(stored_size);
+			max_sizes.push_back(stored_size);
+		} else {
+			min_sizes.push_back(GetLZSSMinSize(size));
+			max_sizes.push_back(GetLZSSMaxSize(size));
+			if (min_sizes.back() != max_sizes.back()) {
+				num_estimated++;
+			}
+		}
+	}
+	fsys_header_data header;
+	fsys_offsets_data offsets;
+	MakeFSYSHeader(header, offsets);
+	PlaceDataOffsets(header.data_start_ofs, min_sizes, keys);
+	uint32_t min_fsys_size = GetFSYSSize(header.data_start_ofs, min_sizes);
+	std::vector<size_t> shared_with = PlaceDataOffsets(header.data_start_ofs, max_sizes, keys);
+	uint32_t max_fsys_size = GetFSYSSize(header.data_start_ofs, max_sizes);
+	std::cout << std::hex;
+	std::cout << "magic: 0x" << header.magic << std::endl;
+	std::cout << "version: 0x" << header.version << std::endl;
+	std::cout << "archive_id: 0x" << header.archive_id << std::endl;
+	std::cout << "num_files: 0x" << header.num_files << std::endl;
+	std::cout << "flags: 0x" << header.flags << std::endl;
+	std::cout << "ofs_table_ofs: 0x" << header.ofs_table_ofs << std::endl;
+	std::cout << "file_list_ofs: 0x" << offsets.file_list_ofs << std::endl;
+	std::cout << "str_ofs: 0x" << offsets.str_ofs << std::endl;
+	std::cout << "data_start_ofs: 0x" << header.data_start_ofs << std::endl;
+	for (size_t i = 0; i < fsys_files.size(); i++) {
+		std::cout << "file " << std::dec << fsys_files[i].id << " " << GetFSYSFileName(fsys_files[i]) << std::hex
+			<< ": offset 0x" << fsys_files[i].offset << " size 0x" << sizes[i];
+		if (min_sizes[i] != max_sizes[i]) {
+			std::cout << " stored 0x" << min_sizes[i] << "-0x" << max_sizes[i] << " (estimated)";
+		} else {
+			std::cout << " stored 0x" << max_sizes[i];
+		}
+		if (shared_with[i] != SIZE_MAX) {
+			std::cout << " (shared)";
+		}
+		std::cout << std::endl;
+	}
+	if (min_fsys_size != max_fsys_size) {
+		std::cout << "fsys_size: 0x" << min_fsys_size << "-0x" << max_fsys_size << std::dec << " (" << min_fsys_size << "-" << max_fsys_size
+			<< " bytes, " << num_estimated << " compressed sizes estimated)" << std::endl;
+	} else {
+		std::cout << "fsys_size: 0x" << max_fsys_size << std::dec << " (" << max_fsys_size << " bytes)" << std::endl;
+	}
+	if (num_estimated && !fsys_store_dir.empty()) {
+		std::cout << "Offsets use the largest possible compressed sizes for files not cached in the store." << std::endl;
+	} else if (num_estimated) {
+		std::cout << "Offsets use the largest possible compressed sizes; use --store for exact sizes." << std::endl;
+	}
+	if (!CheckFSYSBudget(min_fsys_size)) {
+		exit(1);
+	}
+	if (fsys_budget && max_fsys_size > fsys_budget) {
+		std::cout << "Archive may exceed the budget of " << fsys_budget << " bytes." << std::endl;
+	}
+}
+
+void PackFSYS(std::string in_file, std::string out_file)
+{
+	ReadJSON(in_file);
+	ReadFiles(in_file);
+	CompressFiles();
+	WriteFSYS(out_file);
+	if (!fsys_layout.empty() || fsys_share_data) {
+		PrintLayoutReport();
+	}
+	if (!fsys_store_dir.empty()) {
+		PrintStoreStats();
+	}
+}
+
+void PackFSYSTar(std::string in_file, std::string out_file)
+{
+	ReadTar(in_file);
+	CompressFiles();
+	WriteFSYS(out_file);
+	if (!fsys_layout.empty() || fsys_share_data) {
+		PrintLayoutReport();
+	}
+	if (!fsys_store_dir.empty()) {
+		PrintStoreStats();
+	}
+}
+
+#if defined(__linux__)
+std::set<std::string> watch_pending;
+
+bool WatchRebuild(std::string json_filename, std::string out_file, bool manifest_changed, bool all_changed, const std::set<std::string> &changed_files)
+{
+	std::string files_dir = GetFilesDir(json_filename);
+	std::vector<bool> dirty(fsys_files.size(), false);
+	if (all_changed) {
+		manifest_changed = true;
+	}
+	if (manifest_changed) {
+		std::vector<FSYSFile> old_files;
+		uint32_t old_version = fsys_version;
+		bool old_enable_override = fsys_enable_override;
+		uint32_t old_archive_id = fsys_archive_id;
+		old_files.swap(fsys_files);
+		if (!LoadJSON(json_filename)) {
+			//Keep serving the last good manifest
+			fsys_files.swap(old_files);
+			fsys_version = old_version;
+			fsys_enable_override = old_enable_override;
+			fsys_archive_id = old_archive_id;
+			return false;
+		}
+		std::map<std::string, size_t> old_indices;
+		for (size_t i = 0; i < old_files.size(); i++) {
+			old_indices[GetFSYSFileName(old_files[i])] = i;
+		}
+		dirty.assign(fsys_files.size(), true);
+		for (size_t i = 0; i < fsys_files.size(); i++) {
+			auto old_index = old_indices.find(GetFSYSFileName(fsys_files[i]));
+			if (old_index != old_indices.end()) {
+				FSYSFile &old_file = old_files[old_index->second];
+				fsys_files[i].data.swap(old_file.data);
+				fsys_files[i].compressed_data.swap(old_file.compressed_data);
+				dirty[i] = false;
+			}
+		}
+	}
+	for (size_t i = 0; i < fsys_files.size(); i++) {
+		if (all_changed || changed_files.count(GetFSYSFileName(fsys_files[i])) || watch_pending.count(GetFSYSFileName(fsys_files[i]))) {
+			dirty[i] = true;
+		}
+	}
+	watch_pending.clear();
+	for (size_t i = 0; i < fsys_files.size(); i++) {
+		if (dirty[i]) {
+			std::string filename = files_dir + GetFSYSFileName(fsys_files[i]);
+			fsys_files[i].compressed_data.clear();
+			if (!ReadFileData(files_dir, fsys_files[i])) {
+				//Retry on the next change
+				std::cout << "Failed to open " << filename << " for reading." << std::endl;
+				watch_pending.insert(GetFSYSFileName(fsys_files[i]));
+			}
+		}
+	}
+	if (!watch_pending.empty()) {
+		return false;
+	}
+	uint32_t num_compressed = 0;
+	for (size_t i = 0; i < fsys_files.size(); i++) {
+		if (fsys_files[i].compressed && fsys_files[i].compressed_data.empty()) {
+			CompressFileData(fsys_files[i]);
+			num_compressed++;
+		}
+	}
+	//Replace the archive atomically so readers never see a partial file
+	std::string temp_file = out_file + ".tmp";
+	if (!SaveFSYS(temp_file)) {
+		//Keep the last good archive and retry on the next change
+		return false;
+	}
+	if (rename(temp_file.c_str(), out_file.c_str()) != 0) {
+		std::cout << "Failed to replace " << out_file << "." << std::endl;
+		return false;
+	}
+	std::cout << "Rebuilt " << out_file << " (" << num_compressed << " files compressed)";
+	return true;
+}
+#endif
+
+void WatchFSYS(std::string in_file, std::string out_file)
+{
+#if defined(__linux__)
+	size_t slash_pos = in_file.find_last_of("\\/") + 1;
+	std::string json_dir = (slash_pos == 0) ? "." : in_file.substr(0, slash_pos);
+	std::string json_name = in_file.substr(slash_pos);
+	std::string files_dir = GetFilesDir(in_file);
+	PackFSYS(in_file, out_file);
+	int fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0) {
+		std::cout << "Failed to initialize inotify." << std::endl;
+		exit(1);
+	}
+	uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO;
+	int json_wd = inotify_add_watch(fd, json_dir.c_str(), mask);
+	int files_wd = inotify_add_watch(fd, files_dir.c_str(), mask);
+	if (json_wd < 0 || files_wd < 0) {
+		std::cout << "Failed to watch " << json_dir << " and " << files_dir << "." << std::endl;
+		exit(1);
+	}
+	std::cout << "Watching " << in_file << " and " << files_dir << " for changes." << std::endl;
+	while (true) {
+		alignas(struct inotify_event) char buf[4096];
+		bool manifest_changed = false;
+		bool all_changed = false;
+		std::set<std::string> changed_files;
+		int timeout = -1;
+		pollfd poll_fd = { fd, POLLIN, 0 };
+		//Wait for the first event then collect any that follow shortly after
+		while (poll(&poll_fd, 1, timeout) > 0) {
+			ssize_t len = read(fd, buf, sizeof(buf));
+			if (len <= 0) {
+				break;
+			}
+			for (char *ptr = buf; ptr < buf + len; ) {
+				struct inotify_event *event = (struct inotify_event *)ptr;
+				if (event->mask & IN_Q_OVERFLOW) {
+					//Events were lost so nothing can be trusted to be unchanged
+					all_changed = true;
+				}
+				if (event->len) {
+					if (event->wd == json_wd && json_name == event->name) {
+						manifest_changed = true;
+					}
+					if (event->wd == files_wd) {
+						changed_files.insert(event->name);
+					}
+				}
+				ptr += sizeof(struct inotify_event) + event->len;
+			}
+			timeout = 50;
+		}
+		if (!manifest_changed && !all_changed && changed_files.empty()) {
+			continue;
+		}
+		auto start = std::chrono::steady_clock::now();
+		if (WatchRebuild(in_file, out_file, manifest_changed, all_changed, changed_files)) {
+			auto end = std::chrono::steady_clock::now();
+			std::cout << " in " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << " ms." << std::endl;
+		}
+	}
+#else
+	std::cout << "Watch mode is not supported on this platform." << std::endl;
+	exit(1);
+#endif
+}
+
+void ReadFSYSHeader(MappedFile &file, fsys_header_data &header)
+{
+	SeekMap(file, 0);
+	header.magic = ReadMapU32(file);
+	header.version = ReadMapU32(file);
+	header.archive_id = ReadMapU32(file);
+	header.num_files = ReadMapU32(file);
+	header.flags = ReadMapU32(file);
+	header.unk = ReadMapU32(file);
+	header.ofs_table_ofs = ReadMapU32(file);
+	header.data_start_ofs = ReadMapU32(file);
+	header.fsys_size = ReadMapU32(file);
+}
+
+void ReadOffsetTable(MappedFile &file, uint32_t offset, fsys_offsets_data &table)
+{
+	SeekMap(file, offset);
+	table.file_list_ofs = ReadMapU32(file);
+	table.str_ofs = ReadMapU32(file);
+	table.data_ofs = ReadMapU32(file);
+}
+
+void ReadFSYSEntry(MappedFile &file, uint32_t file_ofs, fsys_file_entry &data)
+{
+	SeekMap(file, file_ofs);
+	data.id = ReadMapU32(file);
+	data.offset = ReadMapU32(file);
+	data.size = ReadMapU32(file);
+	data.flags = ReadMapU32(file);
+	data.unk = ReadMapU32(file);
+	data.compressed_size = ReadMapU32(file);
+	data.unk2 = ReadMapU32(file);
+	data.filename_ofs = ReadMapU32(file);
+	data.type = ReadMapU32(file);
+	data.name_ofs = ReadMapU32(file);
+}
+
+void ReadFSYSFile(MappedFile &file, uint32_t file_ofs, FSYSFile &file_info)
+{
+	fsys_file_entry data;
+	ReadFSYSEntry(file, file_ofs, data);
+	file_info.id = data.id;
+	file_info.offset = data.offset;
+	if (data.flags & FILE_COMPRESS_FLAG) {
+		file_info.compressed = true;
+	} else {
+		file_info.compressed = false;
+	}
+	file_info.type = data.type;
+	SeekMap(file, data.name_ofs);
+	file_info.name = ReadMapString(file);
+	file_info.data.resize(data.size);
+	SeekMap(file, data.offset);
+	if (file_info.compressed) {
+		//Decode straight from the mapping and only copy compressed data when the store or index needs it
+		const uint8_t *compressed_data = ReadMapData(file, data.compressed_size);
+		if (fsys_keep_compressed) {
+			file_info.compressed_data.assign(compressed_data, compressed_data + data.compressed_size);
+		}
+		if (!DecodeLZSS(file_info.data.data(), data.size, compressed_data, data.compressed_size)) {
+			std::cout << "Invalid LZSS data." << std::endl;
+			exit(1);
+		}
+	} else {
+		const uint8_t *file_data = ReadMapData(file, data.size);
+		std::copy(file_data, file_data + data.size, file_info.data.begin());
+	}
+}
+
+void ReadFSYSFiles(MappedFile &file, uint32_t file_list_ofs, uint32_t num_files)
+{
+	std::vector<uint32_t> entry_offsets(num_files);
+	size_t arena_size = 0;
+	//Size the arena from the entry table so all payloads share one allocation
+	for (uint32_t i = 0; i < num_files; i++) {
+		SeekMap(file, file_list_ofs + (i * sizeof(uint32_t)));
+		entry_offsets[i] = ReadMapU32(file);
+		SeekMap(file, entry_offsets[i] + 8);
+		arena_size += ReadMapU32(file) + alignof(std::max_align_t);
+		if (fsys_keep_compressed) {
+			SeekMap(file, entry_offsets[i] + 20);
+			arena_size += ReadMapU32(file) + alignof(std::max_align_t);
+		}
+	}
+	//Entries from a previous archive must go before their arena does
+	fsys_files.clear();
+	fsys_arena.reset(new std::pmr::monotonic_buffer_resource(arena_size + 1));
+	fsys_files.reserve(num_files);
+	for (uint32_t i = 0; i < num_files; i++) {
+		fsys_files.push_back(FSYSFile{ 0, 0, FSYSBuffer(fsys_arena.get()), FSYSBuffer(fsys_arena.get()), false, 0, "", "" });
+		ReadFSYSFile(file, entry_offsets[i], fsys_files.back());
+	}
+}
+
+void ReadFSYS(std::string in_file)
+{
+	MappedFile file;
+	if (!MapFSYS(in_file, file)) {
+		std::cout << "Failed to open " << in_file << " for reading." << std::endl;
+		exit(1);
+	}
+	fsys_header_data header;
+	fsys_offsets_data offset_table;
+	ReadFSYSHeader(file, header);
+	if (header.magic != 'FSYS') {
+		std::cout << "Invalid header magic." << std::endl;
+		exit(1);
+	}
+	if (header.flags & FSYS_ENABLE_OVERRIDE) {
+		fsys_enable_override = true;
+	} else {
+		fsys_enable_override = false;
+	}
+	ReadOffsetTable(file, header.ofs_table_ofs, offset_table);
+	fsys_archive_id = header.archive_id;
+	fsys_version = header.version;
+	ReadFSYSFiles(file, offset_table.file_list_ofs, header.num_files);
+	UnmapFile(file);
+}
+
+void WriteJSONHeader(std::ostream &stream)
+{
+	//Matches the layout of dump(4) on the whole document
+	stream << "{\n";
+	stream << "    \"version\": " << fsys_version << ",\n";
+	stream << "    \"override\": " << (fsys_enable_override ? "true" : "false") << ",\n";
+	stream << "    \"id\": " << fsys_archive_id << ",\n";
+	stream << "    \"files\": [";
+}
+
+void WriteJSONEntry(std::ostream &stream, const FSYSFile &file, size_t index)
+{
+	nlohmann::ordered_json json = file;
+	std::string entry = json.dump(4);
+	stream << ((index == 0) ? "\n" : ",\n") << "        ";
+	//Indent the entry to its depth in the files array
+	for (size_t i = 0; i < entry.length(); i++) {
+		stream << entry[i];
+		if (entry[i] == '\n') {
+			stream << "        ";
+		}
+	}
+}
+
+void WriteJSONFooter(std::ostream &stream)
+{
+	if (!fsys_files.empty()) {
+		stream << "\n    ";
+	}
+	stream << "]\n}";
+}
+
+std::string GetJSONString()
+{
+	std::ostringstream stream;
+	WriteJSONHeader(stream);
+	for (size_t i = 0; i < fsys_files.size(); i++) {
+		WriteJSONEntry(stream, fsys_files[i], i);
+	}
+	WriteJSONFooter(stream);
+	return stream.str();
+}
+
+void DumpFSYS(std::string base_path)
+{
+	std::string json_path = base_path + ".json";
+	std::string out_dir_path = base_path + "/";
+	std::ofstream json_file(json_path);
+	if (!MakeDirectory(out_dir_path)) {
+		std::cout << "Failed to create " << out_dir_path << "." << std::endl;
+		exit(1);
+	}
+	if (!json_file.is_open()) {
+		std::cout << "Failed to open " << json_path << " for writing." << std::endl;
+		exit(1);
+	}
+	WriteJSONHeader(json_file);
+	for (size_t i = 0; i < fsys_files.size(); i++) {
+		std::string filename = out_dir_path+GetFSYSFileName(fsys_files[i]);
+		if (!fsys_store_dir.empty()) {
+			DumpStoreFile(fsys_files[i], filename);
+			WriteJSONEntry(json_file, fsys_files[i], i);
+			continue;
+		}
+		WriteJSONEntry(json_file, fsys_files[i], i);
+		FILE *file = fopen(filename.c_str(), "wb");
+		if (!file) {
+			std::cout << "Failed to open " << filename << " for writing." << std::endl;
+			exit(1);
+		}
+		fwrite(&fsys_files[i].data[0], fsys_files[i].data.size(), 1, file);
+		fclose(file);
+	}
+	WriteJSONFooter(json_file);
+}
+
+void DumpFSYSTar(std::string out_file, std::string base_name)
+{
+	FILE *file = OpenStream(out_file, true);
+	if (!file) {
+		std::cout << "Failed to open " << out_file << " for writing." << std::endl;
+		exit(1);
+	}
+	//Manifest comes first so readers can stream the rest
+	std::string json_string = GetJSONString();
+	WriteTarEntry(file, base_name + ".json", (const uint8_t *)json_string.c_str(), json_string.length());
+	for (size_t i = 0; i < fsys_files.size(); i++) {
+		std::string filename = base_name + "/" + GetFSYSFileName(fsys_files[i]);
+		WriteTarEntry(file, filename, fsys_files[i].data.data(), fsys_files[i].data.size());
+	}
+	WriteTarEnd(file);
+	CloseStream(file);
+}
+
+void UnpackFSYS(std::string in_file, std::string base_path)
+{
+	ReadFSYS(in_file);
+	DumpFSYS(base_path);
+	if (!fsys_store_dir.empty()) {
+		PrintStoreStats();
+	}
+}
+
+void UnpackFSYSTar(std::string in_file, std::string out_file)
+{
+	ReadFSYS(in_file);
+	DumpFSYSTar(out_file, GetBaseName(in_file));
+}
+
+struct FSYSIndexEntry {
+	uint32_t id;
+	std::string name;
+	uint32_t type;
+	bool compressed;
+	uint32_t size;
+	uint32_t stored_size;
+	uint64_t raw_hash;
+	uint64_t stored_hash;
+};
+
+struct FSYSIndex {
+	uint64_t archive_size;
+	uint64_t archive_hash;
+	std::vector<FSYSIndexEntry> entries;
+};
+
+std::string GetHashString(uint64_t hash)
+{
+	char string[17];
+	snprintf(string, sizeof(string), "%016llx", (unsigned long long)hash);
+	return string;
+}
+
+uint64_t ParseHashString(std::string string)
+{
+	return strtoull(string.c_str(), nullptr, 16);
+}
+
+void to_json(nlohmann::ordered_json &j, const FSYSIndexEntry &entry)
+{
+	j = nlohmann::ordered_json{
+		{ "id", entry.id },
+		{ "name", entry.name },
+		{ "type", entry.type },
+		{ "compressed", entry.compressed },
+		{ "size", entry.size },
+		{ "stored_size", entry.stored_size },
+		{ "raw_hash", GetHashString(entry.raw_hash) },
+		{ "stored_hash", GetHashString(entry.stored_hash) }
+	};
+}
+
+void from_json(const nlohmann::ordered_json &j, FSYSIndexEntry &entry)
+{
+	j.at("id").get_to(entry.id);
+	j.at("name").get_to(entry.name);
+	j.at("type").get_to(entry.type);
+	j.at("compressed").get_to(entry.compressed);
+	j.at("size").get_to(entry.size);
+	j.at("stored_size").get_to(entry.stored_size);
+	entry.raw_hash = ParseHashString(j.at("raw_hash").get<std::string>());
+	entry.stored_hash = ParseHashString(j.at("stored_hash").get<std::string>());
+}
+
+bool GetArchiveFingerprint(std::string in_file, uint64_t &size, uint64_t &hash)
+{
+	//Hashing the stored bytes is much cheaper than decompressing them
+	MappedFile file;
+	if (!MapFSYS(in_file, file)) {
+		return false;
+	}
+	size = file.size;
+	hash = HashData(file.data, file.size);
+	UnmapFile(file);
+	return true;
+}
+
+void MakeIndex(std::string in_file, FSYSIndex &index)
+{
+	if (!GetArchiveFingerprint(in_file, index.archive_size, index.archive_hash)) {
+		std::cout << "Failed to open " << in_file << " for reading." << std::endl;
+		exit(1);
+	}
+	fsys_keep_compressed = true;
+	fsys_files.clear();
+	ReadFSYS(in_file);
+	index.entries.clear();
+	for (size_t i = 0; i < fsys_files.size(); i++) {
+		const FSYSBuffer &stored_data = GetFSYSFileStoredData(fsys_files[i]);
+		FSYSIndexEntry entry;
+		entry.id = fsys_files[i].id;
+		entry.name = fsys_files[i].name;
+		entry.type = fsys_files[i].type;
+		entry.compressed = fsys_files[i].compressed;
+		entry.size = fsys_files[i].data.size();
+		entry.stored_size = stored_data.size();
+		entry.raw_hash = HashData(fsys_files[i].data.data(), fsys_files[i].data.size());
+		entry.stored_hash = HashData(stored_data.data(), stored_data.size());
+		index.entries.push_back(entry);
+	}
+	fsys_files.clear();
+}
+
+void WriteIndex(std::string out_file, const FSYSIndex &index)
+{
+	std::ofstream file(out_file);
+	nlohmann::ordered_json json;
+	if (!file.is_open()) {
+		std::cout << "Failed to open " << out_file << " for writing." << std::endl;
+		exit(1);
+	}
+	json["archive_size"] = index.archive_size;
+	json["archive_hash"] = GetHashString(index.archive_hash);
+	json["files"] = index.entries;
+	file << json.dump(4);
+}
+
+bool ReadIndex(std::string in_file, FSYSIndex &index)
+{
+	std::ifstream file(in_file);
+	if (!file.is_open()) {
+		return false;
+	}
+	try {
+		nlohmann::ordered_json json = nlohmann::ordered_json::parse(file);
+		json.at("archive_size").get_to(index.archive_size);
+		index.archive_hash = ParseHashString(json.at("archive_hash").get<std::string>());
+		json.at("files").get_to(index.entries);
+	} catch (nlohmann::json::exception &exception) {
+		std::cout << in_file << ": " << exception.what() << std::endl;
+		return false;
+	}
+	return true;
+}
+
+std::string GetIndexName(std::string in_file)
+{
+	std::string image;
+	std::string disc_path;
+	if (!SplitDiscPath(in_file, image, disc_path)) {
+		return in_file + ".idx";
+	}
+	//Indexes of archives inside a disc image live next to the image
+	for (size_t i = 0; i < disc_path.length(); i++) {
+		if (disc_path[i] == '/') {
+			disc_path[i] = '_';
+		}
+	}
+	return image + "." + disc_path + ".idx";
+}
+
+void LoadIndex(std::string in_file, FSYSIndex &index)
+{
+	std::string index_file = GetIndexName(in_file);
+	uint64_t archive_size;
+	uint64_t archive_hash;
+	bool has_index = ReadIndex(index_file, index);
+	if (!GetArchiveFingerprint(in_file, archive_size, archive_hash)) {
+		std::cout << "Failed to open " << in_file << " for reading." << std::endl;
+		exit(1);
+	}
+	if (has_index && index.archive_size == archive_size && index.archive_hash == archive_hash) {
+		return;
+	}
+	MakeIndex(in_file, index);
+	if (has_index) {
+		//Refresh stale sidecars so the next comparison is fast again
+		WriteIndex(index_file, index);
+	}
+}
+
+void IndexFSYS(std::string in_file, std::string out_file)
+{
+	FSYSIndex index;
+	MakeIndex(in_file, index);
+	WriteIndex(out_file, index);
+}
+
+void PrintIndexEntry(std::string label, const FSYSIndexEntry &entry)
+{
+	std::cout << label << " " << entry.id << " " << entry.name << std::endl;
+}
+
+void CompareFSYS(std::string old_file, std::string new_file)
+{
+	FSYSIndex old_index;
+	FSYSIndex new_index;
+	std::map<uint32_t, size_t> old_ids;
+	std::map<uint32_t, size_t> new_ids;
+	std::vector<size_t> removed;
+	std::vector<size_t> added;
+	uint32_t num_changes = 0;
+	LoadIndex(old_file, old_index);
+	LoadIndex(new_file, new_index);
+	for (size_t i = 0; i < old_index.entries.size(); i++) {
+		old_ids.insert(std::make_pair(old_index.entries[i].id, i));
+	}
+	for (size_t i = 0; i < new_index.entries.size(); i++) {
+		new_ids.insert(std::make_pair(new_index.entries[i].id, i));
+	}
+	for (size_t i = 0; i < old_index.entries.size(); i++) {
+		const FSYSIndexEntry &old_entry = old_index.entries[i];
+		auto new_id = new_ids.find(old_entry.id);
+		if (new_id == new_ids.end()) {
+			removed.push_back(i);
+			continue;
+		}
+		const FSYSIndexEntry &new_entry = new_index.entries[new_id->second];
+		if (old_entry.raw_hash != new_entry.raw_hash || old_entry.size != new_entry.size) {
+			PrintIndexEntry("changed", new_entry);
+		} else if (old_entry.name != new_entry.name || old_entry.type != new_entry.type) {
+			std::cout << "renamed " << old_entry.id << " " << old_entry.name << " -> " << new_entry.name << std::endl;
+		} else if (old_entry.stored_hash != new_entry.stored_hash || old_entry.compressed != new_entry.compressed) {
+			PrintIndexEntry("recompressed", new_entry);
+		} else {
+			continue;
+		}
+		num_changes++;
+	}
+	for (size_t i = 0; i < new_index.entries.size(); i++) {
+		if (!old_ids.count(new_index.entries[i].id)) {
+			added.push_back(i);
 		}
-		for (uint32_t i = 0; i < 3; i++) {
-			WriteFileU32(file, 0x11111111);
+	}
+	//Removed and added entries with the same contents were moved to a new id
+	for (size_t i = 0; i < added.size(); i++) {
+		const FSYSIndexEntry &new_entry = new_index.entries[added[i]];
+		bool moved = false;
+		for (size_t j = 0; j < removed.size(); j++) {
+			const FSYSIndexEntry &old_entry = old_index.entries[removed[j]];
+			if (old_entry.raw_hash == new_entry.raw_hash && old_entry.size == new_entry.size) {
+				std::cout << "moved " << old_entry.id << " " << old_entry.name << " -> " << new_entry.id << " " << new_entry.name << std::endl;
+				removed.erase(removed.begin() + j);
+				moved = true;
+				break;
+			}
 		}
-		for (uint32_t i = 0; i < 4; i++) {
-			WriteFileU32(file, 0);
+		if (!moved) {
+			PrintIndexEntry("added", new_entry);
 		}
+		num_changes++;
+	}
+	for (size_t i = 0; i < removed.size(); i++) {
+		PrintIndexEntry("removed", old_index.entries[removed[i]]);
+		num_changes++;
+	}
+	if (num_changes == 0) {
+		std::cout << "No differences found." << std::endl;
 	}
 }
-void WriteFSYSFileEntries(FILE *file, uint32_t file_entry_ofs, uint32_t string_ofs)
+
+size_t server_cache_limit = 0x4000000;
+std::string server_socket_path;
+
+#if !defined(_WIN32)
+struct ServerEntry {
+	fsys_file_entry entry;
+	std::string name;
+	std::string filename;
+};
+
+struct ServerArchive {
+	MappedFile map;
+	dev_t dev;
+	ino_t ino;
+	timespec mtime;
+	off_t size;
+	std::vector<ServerEntry> entries;
+};
+
+struct ServerCacheEntry {
+	std::string key;
+	FSYSBuffer data;
+};
+
+std::map<std::string, ServerArchive> server_archives;
+std::list<ServerCacheEntry> server_cache;
+std::map<std::string, std::list<ServerCacheEntry>::iterator> server_cache_index;
+size_t server_cache_size;
+
+bool MapRangeValid(const MappedFile &map, uint64_t ofs, uint64_t size)
 {
-	uint32_t entry_size = FSYSGetFileListEntrySize();
-	uint32_t name_ofs = string_ofs;
-	uint32_t filename_ofs = name_ofs + FSYSGetNameSize();
-	for (uint32_t i = 0; i < fsys_files.size(); i++) {
-		fsys_file_entry file_entry;
-		file_entry.id = fsys_files[i].id;
-		file_entry.offset = fsys_files[i].offset;
-		file_entry.size = fsys_files[i].data.size();
-		file_entry.unk = 0;
-		if (fsys_files[i].compressed) {
-			file_entry.flags = FILE_COMPRESS_FLAG;
-			file_entry.compressed_size = fsys_files[i].compressed_data.size();
-		} else {
-			file_entry.flags = 0;
-			file_entry.compressed_size = file_entry.size;
-		}
-		file_entry.unk2 = 0;
-		file_entry.filename_ofs = 0;
-		if (fsys_enable_override) {
-			file_entry.filename_ofs = filename_ofs;
-			filename_ofs += GetFSYSFileName(fsys_files[i]).length() + 1;
+	return ofs <= map.size && size <= map.size - ofs;
+}
+
+bool WriteSocketData(int fd, const void *data, size_t size)
+{
+	const uint8_t *ptr = (const uint8_t *)data;
+	while (size) {
+		ssize_t len = write(fd, ptr, size);
+		if (len <= 0) {
+			return false;
 		}
-		file_entry.type = fsys_files[i].type;
-		file_entry.name_ofs = name_ofs;
-		WriteFSYSFileEntry(file, file_entry_ofs + (i * entry_size), file_entry);
-		WriteFSYSFileData(file, i);
-		name_ofs += fsys_files[i].name.length() + 1;
+		ptr += len;
+		size -= len;
 	}
-	fseek(file, file_entry_ofs + (fsys_files.size() * entry_size), SEEK_SET);
-	AlignFile(file, 32);
+	return true;
 }
 
-void WriteFSYSFiles(FILE *file, uint32_t file_list_ofs, uint32_t string_ofs, uint32_t file_entry_ofs)
+bool ReadSocketData(int fd, void *data, size_t size)
 {
-	WriteFSYSFileList(file, file_list_ofs, file_entry_ofs);
-	WriteFSYSStringTable(file, string_ofs);
-	WriteFSYSFileEntries(file, file_entry_ofs, string_ofs);
+	uint8_t *ptr = (uint8_t *)data;
+	while (size) {
+		ssize_t len = read(fd, ptr, size);
+		if (len <= 0) {
+			return false;
+		}
+		ptr += len;
+		size -= len;
+	}
+	return true;
 }
 
-void WriteFSYSFooter(FILE *file)
+bool ReadSocketLine(int fd, std::string &line)
 {
-	fseek(file, 0, SEEK_END);
-	WriteFileU32(file, 0);
-	WriteFileU32(file, 0);
-	WriteFileU32(file, 0);
-	WriteFileU32(file, 0);
-	WriteFileU32(file, 0);
-	WriteFileU32(file, 0);
-	WriteFileU32(file, 0);
-	WriteFileU32(file, 'FSYS');
+	char temp_char;
+	line.clear();
+	while (line.length() < SERVER_MAX_LINE && ReadSocketData(fd, &temp_char, 1)) {
+		if (temp_char == '\n') {
+			return true;
+		}
+		line.push_back(temp_char);
+	}
+	return false;
 }
 
-void WriteFSYS(std::string filename)
+bool MakeSocketAddress(std::string path, sockaddr_un &addr)
 {
-	FILE *file;
-	fsys_header_data header;
-	fsys_offsets_data offsets;
-	file = fopen(filename.c_str(), "wb");
-	if (!file) {
-		std::cout << "Failed to open " << filename << " for writing." << std::endl;
-		exit(1);
-	}
-	header.magic = 'FSYS';
-	header.version = fsys_version;
-	header.archive_id = fsys_archive_id;
-	header.num_files = fsys_files.size();
-	header.flags = 0x80000000;
-	if (fsys_enable_override) {
-		header.flags |= FSYS_ENABLE_OVERRIDE;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.length() >= sizeof(addr.sun_path)) {
+		std::cout << "Socket path " << path << " is too long." << std::endl;
+		return false;
 	}
-	header.unk = 3;
-	header.ofs_table_ofs = sizeof(fsys_header_data);
-	header.data_start_ofs = 0;
-	header.fsys_size = 0;
-	AlignU32(header.ofs_table_ofs, 32);
-	MakeOfsTable(offsets, header.ofs_table_ofs);
-	header.data_start_ofs = offsets.data_ofs;
-	CalcDataOffsets(header.data_start_ofs);
-	WriteFSYSHeader(file, header);
-	WriteFSYSOffsetData(file, offsets, header.ofs_table_ofs);
-	WriteFSYSFiles(file, offsets.file_list_ofs, offsets.str_ofs, offsets.str_ofs + FSYSGetStringDataSize());
-	WriteFSYSFooter(file);
-	header.fsys_size = ftell(file);
-	WriteFSYSHeader(file, header);
-	fclose(file);
+	memcpy(addr.sun_path, path.c_str(), path.length());
+	return true;
 }
 
-void PackFSYS(std::string in_file, std::string out_file)
+timespec GetStatMTime(const struct stat &file_stat)
 {
-	ReadJSON(in_file);
-	ReadFiles(in_file);
-	CompressFiles();
-	WriteFSYS(out_file);
+#if defined(__APPLE__)
+	return file_stat.st_mtimespec;
+#else
+	return file_stat.st_mtim;
+#endif
 }
 
-void ReadFSYSHeader(FILE *file, fsys_header_data &header)
+bool ServerArchiveCurrent(const ServerArchive &archive, const struct stat &file_stat)
 {
-	fseek(file, 0, SEEK_SET);
-	header.magic = ReadFileU32(file);
-	header.version = ReadFileU32(file);
-	header.archive_id = ReadFileU32(file);
-	header.num_files = ReadFileU32(file);
-	header.flags = ReadFileU32(file);
-	header.unk = ReadFileU32(file);
-	header.ofs_table_ofs = ReadFileU32(file);
-	header.data_start_ofs = ReadFileU32(file);
-	header.fsys_size = ReadFileU32(file);
+	//A file replaced by rename has a new inode even when its size and mtime match
+	timespec mtime = GetStatMTime(file_stat);
+	return archive.dev == file_stat.st_dev && archive.ino == file_stat.st_ino && archive.size == file_stat.st_size
+		&& archive.mtime.tv_sec == mtime.tv_sec && archive.mtime.tv_nsec == mtime.tv_nsec;
 }
 
-void ReadOffsetTable(FILE *file, uint32_t offset, fsys_offsets_data &table)
+void ServerEvictArchive(std::string path)
 {
-	fseek(file, offset, SEEK_SET);
-	table.file_list_ofs = ReadFileU32(file);
-	table.str_ofs = ReadFileU32(file);
-	table.data_ofs = ReadFileU32(file);
+	std::string prefix = path + "\n";
+	for (auto cache_entry = server_cache.begin(); cache_entry != server_cache.end(); ) {
+		if (cache_entry->key.compare(0, prefix.length(), prefix) == 0) {
+			server_cache_size -= cache_entry->data.size();
+			server_cache_index.erase(cache_entry->key);
+			cache_entry = server_cache.erase(cache_entry);
+		} else {
+			++cache_entry;
+		}
+	}
+	auto archive = server_archives.find(path);
+	if (archive != server_archives.end()) {
+		UnmapFile(archive->second.map);
+		server_archives.erase(archive);
+	}
 }
 
-void DecodeLZSS(uint8_t *dst, uint8_t *src)
+ServerArchive *ServerOpenArchive(std::string path, std::string &error)
 {
-	uint32_t dst_pos = 0;
-	size_t text_buf_pos = N - F;
-	uint32_t flag = 0;
-	uint32_t magic = ReadMemoryBufU32(&src[0]);
-	uint32_t out_size = ReadMemoryBufU32(&src[4]);
-	uint32_t in_size = ReadMemoryBufU32(&src[8]);
-	if (magic != 'LZSS') {
-		std::cout << "Invalid LZSS data." << std::endl;
-		exit(1);
+	std::string image;
+	std::string disc_path;
+	struct stat file_stat;
+	std::string stat_path = SplitDiscPath(path, image, disc_path) ? image : path;
+	if (stat(stat_path.c_str(), &file_stat) != 0) {
+		error = "Failed to open " + path + " for reading.";
+		ServerEvictArchive(path);
+		return nullptr;
 	}
-	src += 16;
-	in_size -= 16;
-	memset(text_buf, 0, N+F-1);
-	while (dst_pos < out_size) {
-		if (!(flag & 0x100)) {
-			uint8_t value = *src++;
-			flag = 0xFF00 | value;
+	auto archive = server_archives.find(path);
+	if (archive != server_archives.end()) {
+		if (ServerArchiveCurrent(archive->second, file_stat)) {
+			return &archive->second;
 		}
-		if (flag & 0x1) {
-			uint8_t value = *src++;
-			text_buf[text_buf_pos] = dst[dst_pos++] = value;
-			text_buf_pos = (text_buf_pos + 1) % N;
-		} else {
-			uint8_t byte1 = *src++;
-			uint8_t byte2 = *src++;
-			size_t ofs = ((byte2 & 0xF0) << 4) | byte1;
-			size_t copy_size = (byte2 & 0xF) + THRESHOLD + 1;
-			for (size_t i = 0; i < copy_size; i++) {
-				dst[dst_pos++] = text_buf[text_buf_pos] = text_buf[ofs];
-				ofs = (ofs + 1) % N;
-				text_buf_pos = (text_buf_pos + 1) % N;
-			}
+		//Archive changed on disk so drop everything decoded from it
+		ServerEvictArchive(path);
+	}
+	ServerArchive new_archive;
+	fsys_header_data header;
+	fsys_offsets_data offset_table;
+	new_archive.dev = file_stat.st_dev;
+	new_archive.ino = file_stat.st_ino;
+	new_archive.mtime = GetStatMTime(file_stat);
+	new_archive.size = file_stat.st_size;
+	if (!LoadFSYSMap(path, new_archive.map, error)) {
+		return nullptr;
+	}
+	//Validate everything up front since a bad archive must not stop the server
+	MappedFile &map = new_archive.map;
+	bool valid = MapRangeValid(map, 0, sizeof(fsys_header_data));
+	if (valid) {
+		ReadFSYSHeader(map, header);
+		valid = header.magic == 'FSYS' && MapRangeValid(map, header.ofs_table_ofs, sizeof(fsys_offsets_data));
+	}
+	if (valid) {
+		ReadOffsetTable(map, header.ofs_table_ofs, offset_table);
+		valid = MapRangeValid(map, offset_table.file_list_ofs, (uint64_t)header.num_files * 4);
+		fsys_version = header.version;
+	}
+	for (uint32_t i = 0; valid && i < header.num_files; i++) {
+		ServerEntry entry;
+		SeekMap(map, offset_table.file_list_ofs + (i * sizeof(uint32_t)));
+		uint32_t entry_ofs = ReadMapU32(map);
+		valid = MapRangeValid(map, entry_ofs, sizeof(fsys_file_entry));
+		if (!valid) {
+			break;
 		}
-		flag >>= 1;
+		ReadFSYSEntry(map, entry_ofs, entry.entry);
+		uint32_t stored_size = (entry.entry.flags & FILE_COMPRESS_FLAG) ? entry.entry.compressed_size : entry.entry.size;
+		valid = MapRangeValid(map, entry.entry.name_ofs, 1) && MapRangeValid(map, entry.entry.offset, stored_size)
+			&& memchr(map.data + entry.entry.name_ofs, 0, map.size - entry.entry.name_ofs) != nullptr;
+		if ((entry.entry.flags & FILE_COMPRESS_FLAG) && valid) {
+			//LZSS expands at most 9 times so larger sizes cannot be real and are never allocated
+			valid = stored_size >= 16 && ReadMemoryBufU32(map.data + entry.entry.offset) == 'LZSS'
+				&& ReadMemoryBufU32(map.data + entry.entry.offset + 4) == entry.entry.size
+				&& entry.entry.size <= (uint64_t)(stored_size - 16) * 9;
+		}
+		if (valid) {
+			FSYSFile file_info = {};
+			SeekMap(map, entry.entry.name_ofs);
+			entry.name = ReadMapString(map);
+			file_info.name = entry.name;
+			file_info.type = entry.entry.type;
+			entry.filename = GetFSYSFileName(file_info);
+			new_archive.entries.push_back(entry);
+		}
+	}
+	if (!valid) {
+		UnmapFile(map);
+		error = path + " is not a valid FSYS archive.";
+		return nullptr;
 	}
+	ServerArchive &added_archive = server_archives[path];
+	added_archive = new_archive;
+	return &added_archive;
 }
 
-void ReadFSYSFile(FILE *file, uint32_t file_ofs, FSYSFile &file_info)
+void ServerSendError(int fd, std::string error)
 {
-	fsys_file_entry data;
-	fseek(file, file_ofs, SEEK_SET);
-	data.id = ReadFileU32(file);
-	data.offset = ReadFileU32(file);
-	data.size = ReadFileU32(file);
-	data.flags = ReadFileU32(file);
-	data.unk = ReadFileU32(file);
-	data.compressed_size = ReadFileU32(file);
-	data.unk2 = ReadFileU32(file);
-	data.filename_ofs = ReadFileU32(file);
-	data.type = ReadFileU32(file);
-	data.name_ofs = ReadFileU32(file);
-	file_info.id = data.id;
-	file_info.offset = data.offset;
-	if (data.flags & FILE_COMPRESS_FLAG) {
-		file_info.compressed = true;
-	} else {
-		file_info.compressed = false;
-	}
-	file_info.type = data.type;
-	fseek(file, data.name_ofs, SEEK_SET);
-	file_info.name = ReadFileString(file);
-	file_info.data.resize(data.size);
-	if (file_info.compressed) {
-		file_info.compressed_data.resize(data.compressed_size);
-		fseek(file, data.offset, SEEK_SET);
-		fread(&file_info.compressed_data[0], data.compressed_size, 1, file);
-		DecodeLZSS(&file_info.data[0], &file_info.compressed_data[0]);
-	} else {
-		fseek(file, data.offset, SEEK_SET);
-		fread(&file_info.data[0], data.size, 1, file);
+	std::string line = nlohmann::ordered_json{ { "error", error } }.dump() + "\n";
+	WriteSocketData(fd, line.c_str(), line.length());
+}
+
+void ServerSendData(int fd, const uint8_t *data, size_t size)
+{
+	std::string line = nlohmann::ordered_json{ { "size", size } }.dump() + "\n";
+	if (WriteSocketData(fd, line.c_str(), line.length())) {
+		WriteSocketData(fd, data, size);
 	}
 }
 
-void ReadFSYSFiles(FILE *file, uint32_t file_list_ofs, uint32_t num_files)
+void ServerList(int fd, ServerArchive &archive)
 {
-	for (uint32_t i = 0; i < num_files; i++) {
-		FSYSFile file_info;
-		fseek(file, file_list_ofs + (i * sizeof(uint32_t)), SEEK_SET);
-		ReadFSYSFile(file, ReadFileU32(file), file_info);
-		fsys_files.push_back(file_info);
+	nlohmann::ordered_json json = nlohmann::ordered_json::array();
+	for (size_t i = 0; i < archive.entries.size(); i++) {
+		const fsys_file_entry &entry = archive.entries[i].entry;
+		json.push_back(nlohmann::ordered_json{
+			{ "id", entry.id },
+			{ "name", archive.entries[i].name },
+			{ "filename", archive.entries[i].filename },
+			{ "type", entry.type },
+			{ "compressed", (entry.flags & FILE_COMPRESS_FLAG) != 0 },
+			{ "size", entry.size },
+			{ "stored_size", (entry.flags & FILE_COMPRESS_FLAG) ? entry.compressed_size : entry.size }
+		});
 	}
+	std::string list = json.dump();
+	ServerSendData(fd, (const uint8_t *)list.c_str(), list.length());
 }
 
-void ReadFSYS(std::string in_file)
+void ServerRead(int fd, std::string path, ServerArchive &archive, std::string name)
 {
-	FILE *file = fopen(in_file.c_str(), "rb");
-	if (!file) {
-		std::cout << "Failed to open " << in_file << " for reading." << std::endl;
-		exit(1);
+	size_t index;
+	for (index = 0; index < archive.entries.size(); index++) {
+		const ServerEntry &entry = archive.entries[index];
+		if (entry.name == name || entry.filename == name || std::to_string(entry.entry.id) == name) {
+			break;
+		}
 	}
-	fsys_header_data header;
-	fsys_offsets_data offset_table;
-	ReadFSYSHeader(file, header);
-	if (header.magic != 'FSYS') {
-		std::cout << "Invalid header magic." << std::endl;
-		exit(1);
+	if (index == archive.entries.size()) {
+		ServerSendError(fd, "No file named " + name + " in " + path + ".");
+		return;
 	}
-	if (header.flags & FSYS_ENABLE_OVERRIDE) {
-		fsys_enable_override = true;
-	} else {
-		fsys_enable_override = false;
+	const fsys_file_entry &entry = archive.entries[index].entry;
+	const uint8_t *stored_data = archive.map.data + entry.offset;
+	if (!(entry.flags & FILE_COMPRESS_FLAG)) {
+		//Uncompressed files are served straight from the mapping
+		std::cout << "read " << path << " " << name << " (mapped)" << std::endl;
+		ServerSendData(fd, stored_data, entry.size);
+		return;
+	}
+	std::string key = path + "\n" + std::to_string(index);
+	auto cache_entry = server_cache_index.find(key);
+	if (cache_entry != server_cache_index.end()) {
+		//Move to the front so the least recently used entry is last
+		server_cache.splice(server_cache.begin(), server_cache, cache_entry->second);
+		std::cout << "read " << path << " " << name << " (cached)" << std::endl;
+		ServerSendData(fd, cache_entry->second->data.data(), cache_entry->second->data.size());
+		return;
+	}
+	FSYSBuffer data(entry.size);
+	if (!DecodeLZSS(data.data(), entry.size, stored_data, entry.compressed_size)) {
+		ServerSendError(fd, "Invalid LZSS data for " + name + " in " + path + ".");
+		return;
+	}
+	std::cout << "read " << path << " " << name << " (decoded)" << std::endl;
+	ServerSendData(fd, data.data(), data.size());
+	if (data.size() > server_cache_limit) {
+		return;
+	}
+	server_cache.push_front(ServerCacheEntry{ key, FSYSBuffer() });
+	server_cache.front().data.swap(data);
+	server_cache_index[key] = server_cache.begin();
+	server_cache_size += server_cache.front().data.size();
+	while (server_cache_size > server_cache_limit) {
+		server_cache_size -= server_cache.back().data.size();
+		server_cache_index.erase(server_cache.back().key);
+		server_cache.pop_back();
 	}
-	ReadOffsetTable(file, header.ofs_table_ofs, offset_table);
-	fsys_archive_id = header.archive_id;
-	fsys_version = header.version;
-	ReadFSYSFiles(file, offset_table.file_list_ofs, header.num_files);
-	fclose(file);
 }
 
-void DumpFSYS(std::string base_path)
+void ServerHandleClient(int fd)
 {
-	std::string json_path = base_path + ".json";
-	std::string out_dir_path = base_path + "/";
-	std::ofstream json_file(json_path);
-	nlohmann::ordered_json json;
-	if (!MakeDirectory(out_dir_path)) {
-		std::cout << "Failed to create " << out_dir_path << "." << std::endl;
+	std::string line;
+	std::string error;
+	if (!ReadSocketLine(fd, line)) {
+		return;
+	}
+	try {
+		nlohmann::ordered_json request = nlohmann::ordered_json::parse(line);
+		std::string op = request.at("op").get<std::string>();
+		std::string path = request.at("archive").get<std::string>();
+		ServerArchive *archive = ServerOpenArchive(path, error);
+		if (!archive) {
+			ServerSendError(fd, error);
+		} else if (op == "list") {
+			ServerList(fd, *archive);
+		} else if (op == "read") {
+			ServerRead(fd, path, *archive, request.at("entry").get<std::string>());
+		} else {
+			ServerSendError(fd, "Invalid request " + op + ".");
+		}
+	} catch (nlohmann::json::exception &exception) {
+		ServerSendError(fd, exception.what());
+	}
+}
+#endif
+
+void ServeFSYS(std::string socket_path)
+{
+#if !defined(_WIN32)
+	sockaddr_un addr;
+	int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server_fd < 0 || !MakeSocketAddress(socket_path, addr)) {
+		std::cout << "Failed to create socket " << socket_path << "." << std::endl;
 		exit(1);
 	}
-	if (!json_file.is_open()) {
-		std::cout << "Failed to open " << json_path << " for writing." << std::endl;
+	//Remove a socket left behind by a previous server
+	unlink(socket_path.c_str());
+	if (bind(server_fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(server_fd, 16) != 0) {
+		std::cout << "Failed to listen on " << socket_path << "." << std::endl;
 		exit(1);
 	}
-	json["version"] = fsys_version;
-	json["override"] = fsys_enable_override;
-	json["id"] = fsys_archive_id;
-	json["files"] = fsys_files;
-	json_file << json.dump(4);
-	for (size_t i = 0; i < fsys_files.size(); i++) {
-		std::string filename = out_dir_path+GetFSYSFileName(fsys_files[i]);
-		FILE *file = fopen(filename.c_str(), "wb");
-		if (!file) {
-			std::cout << "Failed to open " << filename << " for writing." << std::endl;
-			exit(1);
+	signal(SIGPIPE, SIG_IGN);
+	std::cout << "Serving on " << socket_path << " with a " << server_cache_limit << " byte cache." << std::endl;
+	while (true) {
+		//Requests are handled one at a time, one per connection
+		int client_fd = accept(server_fd, nullptr, nullptr);
+		if (client_fd < 0) {
+			continue;
 		}
-		fwrite(&fsys_files[i].data[0], fsys_files[i].data.size(), 1, file);
-		fclose(file);
+		//Drop clients that stall so they cannot hold up everyone else
+		timeval timeout = { SERVER_TIMEOUT_SEC, 0 };
+		setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		ServerHandleClient(client_fd);
+		close(client_fd);
 	}
+#else
+	std::cout << "Server mode is not supported on this platform." << std::endl;
+	exit(1);
+#endif
 }
 
-void UnpackFSYS(std::string in_file, std::string base_path)
+void RequestFSYS(std::string socket_path, std::string archive, std::string name)
 {
-	ReadFSYS(in_file);
-	DumpFSYS(base_path);
+#if !defined(_WIN32)
+	sockaddr_un addr;
+	std::string image;
+	std::string disc_path;
+	std::string line;
+	nlohmann::ordered_json request;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (socket_path.empty()) {
+		std::cout << "A server socket must be given with --server." << std::endl;
+		exit(1);
+	}
+	if (fd < 0 || !MakeSocketAddress(socket_path, addr) || connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+		std::cout << "Failed to connect to " << socket_path << "." << std::endl;
+		exit(1);
+	}
+	//The server may run from another directory so send absolute paths
+	bool is_disc_path = SplitDiscPath(archive, image, disc_path);
+	char *real_path = realpath((is_disc_path ? image : archive).c_str(), nullptr);
+	if (real_path) {
+		archive = (is_disc_path) ? std::string(real_path) + "::" + disc_path : std::string(real_path);
+		free(real_path);
+	}
+	request["op"] = (name.empty()) ? "list" : "read";
+	request["archive"] = archive;
+	if (!name.empty()) {
+		request["entry"] = name;
+	}
+	line = request.dump() + "\n";
+	if (!WriteSocketData(fd, line.c_str(), line.length()) || !ReadSocketLine(fd, line)) {
+		std::cout << "Failed to communicate with " << socket_path << "." << std::endl;
+		exit(1);
+	}
+	nlohmann::ordered_json response = nlohmann::ordered_json::parse(line, nullptr, false);
+	if (response.is_discarded() || response.contains("error") || !response.contains("size")) {
+		std::cout << (response.contains("error") ? response["error"].get<std::string>() : "Invalid response from server.") << std::endl;
+		exit(1);
+	}
+	FSYSBuffer data(response["size"].get<size_t>());
+	if (!ReadSocketData(fd, data.data(), data.size())) {
+		std::cout << "Failed to communicate with " << socket_path << "." << std::endl;
+		exit(1);
+	}
+	close(fd);
+	if (name.empty()) {
+		std::cout << nlohmann::ordered_json::parse(data.begin(), data.end()).dump(4) << std::endl;
+	} else {
+		fwrite(data.data(), data.size(), 1, stdout);
+		fflush(stdout);
+	}
+#else
+	std::cout << "Server mode is not supported on this platform." << std::endl;
+	exit(1);
+#endif
 }
 
 int main(int argc, char **argv)
 {
-	if (argc != 3 && argc != 4) {
-		std::cout << "Usage: " << argv[0] << " -p/u input output" << std::endl;
+	std::vector<std::string> args;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--store" && i + 1 < argc) {
+			fsys_store_dir = argv[++i];
+			fsys_keep_compressed = true;
+		} else if (arg == "--server" && i + 1 < argc) {
+			server_socket_path = argv[++i];
+		} else if (arg == "--cache" && i + 1 < argc) {
+			server_cache_limit = strtoull(argv[++i], nullptr, 0);
+		} else if (arg == "--budget" && i + 1 < argc) {
+			fsys_budget = strtoul(argv[++i], nullptr, 0);
+		} else if (arg == "--share") {
+			fsys_share_data = true;
+		} else if (arg == "--layout" && i + 1 < argc) {
+			fsys_layout = argv[++i];
+			if (fsys_layout != "size" && fsys_layout != "type" && fsys_layout.compare(0, 6, "trace:") != 0) {
+				std::cout << "Invalid layout " << fsys_layout << std::endl;
+				return 1;
+			}
+		} else {
+			args.push_back(arg);
+		}
+	}
+	if (args.size() != 2 && args.size() != 3) {
+		std::cout << "Usage: " << argv[0] << " -p/u/pt/ut/w/i/c/d/s/sl/sr input output [--store dir] [--layout size/type/trace:file] [--share] [--budget size] [--server socket] [--cache size]" << std::endl;
 		std::cout << "-p is used in the second argument when packing the input JSON into an output FSYS file." << std::endl;
 		std::cout << "-u is used in the second argument when dumping an input FSYS file into a base path." << std::endl;
+		std::cout << "-pt is used in the second argument when packing an input tar stream into an output FSYS file." << std::endl;
+		std::cout << "-ut is used in the second argument when dumping an input FSYS file into an output tar stream." << std::endl;
+		std::cout << "-w is used in the second argument when packing the input JSON like -p and then repacking whenever it or its files change." << std::endl;
+		std::cout << "-i is used in the second argument when writing a fingerprint index of an input FSYS file, by default to input.idx or image.path_in_disc.idx." << std::endl;
+		std::cout << "-c is used in the second argument when comparing the entries of an input FSYS file with an output FSYS file." << std::endl;
+		std::cout << "Comparisons use up to date .idx files next to each archive instead of decompressing it." << std::endl;
+		std::cout << "-d is used in the second argument when printing the header and file offsets that packing the input JSON would produce without writing anything." << std::endl;
+		std::cout << "--budget fails packing or -d when the archive would be larger than the given size in bytes." << std::endl;
+		std::cout << "-s is used in the second argument when serving FSYS files on the input Unix socket, keeping up to --cache bytes of decompressed files." << std::endl;
+		std::cout << "-sl is used in the second argument when listing the files of an input FSYS file through the --server socket." << std::endl;
+		std::cout << "-sr is used in the second argument when writing the output file of an input FSYS file, by name or id, to stdout through the --server socket." << std::endl;
+		std::cout << "FSYS inputs may be inside a GameCube disc image, written as image.iso::path/in/disc.fsys." << std::endl;
+		std::cout << "With -u, -ut and -i the path may use * and ? to process every matching archive, with the output as a directory that keeps the disc directories." << std::endl;
+		std::cout << "Tar streams may be - to use stdin or stdout." << std::endl;
 		std::cout << "The output parameter is optional and will generate an output name based on the input name if not provided." << std::endl;
+		std::cout << "--store shares dumped files through a content-addressed store directory, linking each file to its stored copy." << std::endl;
+		std::cout << "When packing, --store resolves missing files and reuses compressed data from the store." << std::endl;
+		std::cout << "--layout places file data by size, by type, or by the order of names listed in a trace file while keeping the file list order." << std::endl;
+		std::cout << "--share stores files with identical data once, pointing their entries at the same offset." << std::endl;
 		return 1;
 	}
-	std::string option_arg = argv[1];
-	std::string in_name = argv[2];
-	std::string out_name;
-	if (argc == 4) {
-		out_name = argv[3];
+	std::string option_arg = args[0];
+	std::vector<std::string> in_names;
+	if (option_arg == "-u" || option_arg == "-ut" || option_arg == "-i") {
+		in_names = ExpandDiscPath(args[1]);
 	} else {
-		out_name = in_name.substr(0, in_name.find_last_of("."));
+		in_names.push_back(args[1]);
 	}
-	if (option_arg == "-p") {
-		if (argc != 4) {
-			out_name += ".fsys";
-		}
-		PackFSYS(in_name, out_name);
-	} else if (option_arg == "-u") {
-		UnpackFSYS(in_name, out_name);
-	} else {
-		std::cout << "Invalid second argument " << option_arg << std::endl;
+	if (in_names.size() > 1 && args.size() == 3 && !MakeDirectory(args[2])) {
+		std::cout << "Failed to create " << args[2] << "." << std::endl;
 		return 1;
 	}
+	for (size_t i = 0; i < in_names.size(); i++) {
+		std::string in_name = in_names[i];
+		std::string out_name;
+		std::string image;
+		std::string disc_path;
+		bool has_out_name = args.size() == 3;
+		bool is_disc_path = SplitDiscPath(in_name, image, disc_path);
+		if (in_names.size() > 1) {
+			//Output names a directory when several archives match
+			out_name = GetDiscOutputName(has_out_name ? args[2] + "/" : "", disc_path);
+			has_out_name = false;
+		} else if (has_out_name) {
+			out_name = args[2];
+		} else if (in_name == "-") {
+			std::cout << "An output name is required when reading from stdin." << std::endl;
+			return 1;
+		} else if (is_disc_path) {
+			out_name = GetBaseName(disc_path);
+		} else {
+			out_name = in_name.substr(0, in_name.find_last_of("."));
+		}
+		if (option_arg == "-p") {
+			if (!has_out_name) {
+				out_name += ".fsys";
+			}
+			PackFSYS(in_name, out_name);
+		} else if (option_arg == "-u") {
+			UnpackFSYS(in_name, out_name);
+		} else if (option_arg == "-d") {
+			PlanFSYS(in_name);
+		} else if (option_arg == "-s") {
+			ServeFSYS(in_name);
+		} else if (option_arg == "-sl") {
+			RequestFSYS(server_socket_path, in_name, "");
+		} else if (option_arg == "-sr") {
+			if (!has_out_name) {
+				std::cout << "A file name or id is required." << std::endl;
+				return 1;
+			}
+			RequestFSYS(server_socket_path, in_name, out_name);
+		} else if (option_arg == "-i") {
+			if (in_names.size() > 1 && args.size() == 3) {
+				//Keep the index inside the output directory
+				out_name += ".idx";
+			} else if (!has_out_name) {
+				out_name = GetIndexName(in_name);
+			}
+			IndexFSYS(in_name, out_name);
+		} else if (option_arg == "-c") {
+			if (!has_out_name) {
+				std::cout << "Two FSYS files are required for comparison." << std::endl;
+				return 1;
+			}
+			CompareFSYS(in_name, out_name);
+		} else if (option_arg == "-w") {
+			if (!has_out_name) {
+				out_name += ".fsys";
+			}
+			WatchFSYS(in_name, out_name);
+		} else if (option_arg == "-pt") {
+			if (!has_out_name) {
+				out_name += ".fsys";
+			}
+			PackFSYSTar(in_name, out_name);
+		} else if (option_arg == "-ut") {
+			if (!has_out_name) {
+				out_name += ".tar";
+			}
+			UnpackFSYSTar(in_name, out_name);
+		} else {
+			std::cout << "Invalid second argument " << option_arg << std::endl;
+			return 1;
+		}
+	}
 	return 0;
 }